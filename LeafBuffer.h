@@ -1,9 +1,17 @@
 #ifndef LEAFSTORE_H
 #define LEAFSTORE_H
 
+#include <iostream>
 #include <vector>
 #include <map>
 #include <string>
+#include <memory>
+#include <cassert>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+
+#include "Rtypes.h"
 
 // https://root.cern.ch/doc/v610/classTBranch.html
 
@@ -33,34 +41,124 @@ static const std::map<std::string, LeafType> LeafTypeFromStr
     {"Long64_t",  leaf_long64},
     {"ULong64_t", leaf_ulong64}
 };
+static const std::map<LeafType, size_t> LeafTypeSize
+{
+    {leaf_char,    sizeof(Char_t)},
+    {leaf_uchar,   sizeof(UChar_t)},
+    {leaf_short,   sizeof(Short_t)},
+    {leaf_ushort,  sizeof(UShort_t)},
+    {leaf_int,     sizeof(Int_t)},
+    {leaf_uint,    sizeof(UInt_t)},
+    {leaf_float,   sizeof(Float_t)},
+    {leaf_double,  sizeof(Double_t)},
+    {leaf_long64,  sizeof(Long64_t)},
+    {leaf_ulong64, sizeof(ULong64_t)}
+};
 // Datatype postfix
 static const std::string DataTypeNamesShort = "BbSsIiFDLlO";
 
-/* LeafBuffer: Class providing data buffer addresses for the event loop.
-*  Since Leaves may contain arrays, the data buffers are stored as a vector
+/* LeafArena: Contiguous memory block holding the buffers of all leaves of a job.
+*  Buffers are handed out in the order the leaves are added, which is the order in
+*  which they are read in the event loop. reset() keeps the memory, such that the next
+*  job or input file with the same schema does not allocate at all.
 */
 
-template<typename T>
-class LeafBuffer {
+class LeafArena {
 public:
-    LeafBuffer()
+    static constexpr size_t alignment = 64; // Cache line
+
+    // Upper bound of bytes needed by a buffer of length elements of size elem_size
+    static constexpr size_t footprint(size_t elem_size, size_t length)
+    {
+        return elem_size * length + elem_size - 1;
+    }
+
+    // Makes sure that n_bytes can be handed out. Must be called before the first
+    // allocate() after reset(), since growing invalidates all handed out buffers
+    void reserve(size_t n_bytes)
+    {
+        assert (offset == 0);
+        if (n_bytes > capacity) {
+            size_t new_capacity = (n_bytes + alignment - 1) / alignment * alignment;
+            data.reset(static_cast<char*>(std::aligned_alloc(alignment, new_capacity)));
+            if (data == nullptr) {
+                std::cerr << "\033[07m\033[91m[ERROR]\033[0m Cannot allocate " << new_capacity
+                          << " bytes for leaf buffers\n";
+                exit(1);
+            }
+            capacity = new_capacity;
+        }
+        if (n_bytes > 0) {
+            std::memset(data.get(), 0, n_bytes);
+        }
+    }
+
+    template<typename T>
+    T* allocate(size_t length)
+    {
+        offset = (offset + alignof(T) - 1) / alignof(T) * alignof(T);
+        assert (offset + length * sizeof(T) <= capacity);
+        T* buffer = reinterpret_cast<T*>(data.get() + offset);
+        offset += length * sizeof(T);
+        return buffer;
+    }
+
+    void reset() noexcept
     {
-        buffer.reserve(1);
+        offset = 0;
     }
 
-    LeafBuffer(size_t length)
+    // Frees memory
+    void release() noexcept
+    {
+        data.reset();
+        offset   = 0;
+        capacity = 0;
+    }
+
+    size_t reserved() const noexcept { return capacity; }
+
+private:
+    struct FreeDeleter {
+        void operator()(char* ptr) const { std::free(ptr); }
+    };
+    std::unique_ptr<char, FreeDeleter> data; //!
+    size_t offset   = 0;
+    size_t capacity = 0;
+};
+
+/* LeafBuffer: Class providing data buffer addresses for the event loop.
+*  Since Leaves may contain arrays, the data buffers are stored in the leaf arena.
+*  Leaves that are flattened have a separate slot for the current array element
+*  in front of the input array, such that the input array stays intact.
+*/
+
+template<typename T>
+class LeafBuffer {
+public:
+    LeafBuffer(T* slot, T* input, int stride, int group,
+               const std::string& name, const std::string& leaflist)
+        : buffer(slot), input(input), stride(stride), group(group),
+          name(name), leaflist(leaflist)
     {
-        assert (length >= 1);
-        buffer.reserve(length);
     }
 
     void inline increment(int offset) {
-        // Move next element to address &buffer[0] from where
-        // the next element is read from when flattening arrays
-        buffer[0] = buffer[offset];
+        // Copy array element to address &buffer[0] from where
+        // it is read when filling the output tree
+        if (stride == 1) {
+            buffer[0] = input[offset];
+        }
+        else {
+            std::copy_n(input + offset * stride, stride, buffer);
+        }
     }
 
-    std::vector<T> buffer;  // Temporary buffer containing all array elements
+    T* buffer;     //! Output address, current array element of flattened leaves
+    T* input;      //! Input address, buffer in leaf arena containing all array elements
+    int stride;    // Number of elements per array entry, > 1 for [n][k] leaves
+    int group;     // Array length leaf group of flattened leaves, -1 otherwise
+    std::string name, leaflist;
 };
 
 #endif // LEAFSTORE_H
@@ -1,6 +1,8 @@
 #include "Riostream.h"
 #include "Ranger.h"
 
+#include <glob.h>
+
 ClassImp(Ranger);
 
 Ranger::Ranger(const TString& rootfile)
@@ -12,6 +14,22 @@ Ranger::Ranger(const TString& rootfile)
 }
 
 
+Ranger::Ranger(const std::vector<std::string>& rootfiles)
+{
+    distr = std::uniform_int_distribution<std::mt19937::result_type>(0, ULONG_MAX);
+    TTree::SetMaxTreeSize(1000000000000);
+    setInputFiles(rootfiles);
+}
+
+
+Ranger::~Ranger()
+{
+    input_trees.clear();
+    input_chains.clear();
+    closeFile(input_file.get());
+}
+
+
 void Ranger::closeFile(TFile* fileptr)
 {
     if (fileptr != nullptr) {
@@ -45,27 +63,158 @@ void Ranger::clearLeafBuffers() noexcept
     leaf_buffers_D.second.clear();
     leaf_buffers_L.second.clear();
     leaf_buffers_l.second.clear();
+
+    // Keep memory for next job
+    leaf_arena.reset();
+}
+
+
+void Ranger::setLeafBufferMemoryLimit(size_t n_bytes)
+{
+    leaf_memory_limit = n_bytes;
+    if (leaf_memory_limit > 0 && leaf_arena.reserved() > leaf_memory_limit) {
+        leaf_arena.release();
+    }
+}
+
+
+void Ranger::reserveLeafArena(size_t n_bytes)
+{
+    if (leaf_memory_limit > 0 && n_bytes > leaf_memory_limit) {
+        std::cerr << "\033[07m\033[91m[ERROR]\033[0m Leaf buffers require " << n_bytes
+                  << " bytes, which exceeds the memory limit of " << leaf_memory_limit << " bytes\n";
+        exit(1);
+    }
+    leaf_arena.reserve(n_bytes);
 }
 
 
 void Ranger::setInputFile(const TString& rootfile)
 {
-    input_filename = rootfile;
+    setInputFiles({std::string(rootfile)});
+}
 
-    auto inFile = FilePtr(TFile::Open(TString(rootfile), "READ"));
+
+void Ranger::setInputFiles(const std::vector<std::string>& rootfiles)
+{
+    // Input files may contain wildcards. Trees in all files are processed as one TChain
+    input_filenames.clear();
+    for (const auto& pattern : rootfiles) {
+        auto files = expandInputPattern(pattern);
+        if (files.empty()) {
+            std::cerr << "\033[07m\033[91m[ERROR]\033[0m No file matches " << pattern << '\n';
+            exit(1);
+        }
+        input_filenames.insert(input_filenames.end(), files.begin(), files.end());
+    }
+    if (input_filenames.empty()) {
+        std::cerr << "\033[07m\033[91m[ERROR]\033[0m No input files given\n";
+        exit(1);
+    }
+    input_filename = input_filenames.front();
+
+    // Drop handles and schemas of previous input
+    input_trees.clear();
+    input_chains.clear();
+    schema_cache.clear();
+    closeFile(input_file.get());
+
+    // First file stays open for all following runs. Further files are opened by
+    // TChain, which reports files that cannot be read
+    input_file = FilePtr(TFile::Open(input_filename, "READ"));
 
     // Check whether root file is healthy
-    if (!inFile->IsOpen()) {
+    if (input_file == nullptr || !input_file->IsOpen()) {
         std::cerr << "\033[07m\033[91m[ERROR]\033[0m Cannot open file " + input_filename << '\n';
         exit(1);
     }
-    if (inFile->IsZombie()) {
+    if (input_file->IsZombie()) {
         std::cerr << "\033[07m\033[91m[ERROR]\033[0m Root file appears to be damaged. giving up!\n";
         exit(1);
     }
     clearLeafBuffers();
     formula_buffer.clear();
-    inFile->Close();
+}
+
+
+std::vector<std::string> Ranger::expandInputPattern(const std::string& pattern)
+{
+    // Expands wildcards in local paths, remote URLs are kept as they are
+    if (pattern.find_first_of("*?[") == std::string::npos || pattern.find("://") != std::string::npos) {
+        return {pattern};
+    }
+    std::vector<std::string> files;
+    glob_t matches;
+    if (glob(pattern.c_str(), 0, nullptr, &matches) == 0) {
+        for (size_t m = 0; m < matches.gl_pathc; ++m) {
+            files.push_back(matches.gl_pathv[m]);
+        }
+    }
+    globfree(&matches);
+    return files;
+}
+
+
+TTree* Ranger::getInputTree(const TreeJob& tree_job)
+{
+    // Returns tree_in, which is shared by all jobs on this tree. A single input file
+    // is read directly, multiple files are chained. Entries of a chain are numbered
+    // globally and branch addresses are rebound by TChain when the next file is loaded.
+    // Branch status and addresses of previous jobs are reset.
+    auto cached = input_trees.find(tree_job["tree_in"]);
+    if (cached != input_trees.end()) {
+        cached->second->ResetBranchAddresses();
+        cached->second->SetBranchStatus("*", 1);
+        return cached->second;
+    }
+
+    TTree* input_tree = nullptr;
+    if (input_filenames.size() == 1) {
+        input_tree = static_cast<TTree*>(input_file->Get(tree_job("tree_in")));
+    }
+    else {
+        auto chain = std::make_unique<TChain>(tree_job("tree_in"));
+        for (const auto& file : input_filenames) {
+            chain->AddFile(file.c_str());
+        }
+        chain->LoadTree(0);
+        input_tree = chain.get();
+        input_chains.push_back(std::move(chain));
+    }
+    input_trees[tree_job["tree_in"]] = input_tree;
+    return input_tree;
+}
+
+
+Ranger::TreeSchema& Ranger::getTreeSchema(const TreeJob& tree_job, TTree* input_tree)
+{
+    // Returns leaf structure of tree_in, analyzed once for all jobs on this tree
+    auto cached = schema_cache.find(tree_job["tree_in"]);
+    if (cached != schema_cache.end()) {
+        return cached->second;
+    }
+    TreeSchema& schema = schema_cache[tree_job["tree_in"]];
+
+    TObjArray* leaf_list = input_tree->GetListOfLeaves();
+    if (leaf_list == nullptr) {
+        // Empty chain
+        return schema;
+    }
+    for (const auto& obj : *leaf_list) {
+        auto leaf = static_cast<TLeaf*>(obj);
+        auto type = LeafTypeFromStr.find(leaf->GetTypeName());
+        if (type == LeafTypeFromStr.end()) {
+            // Unsupported leaf type
+            continue;
+        }
+        Int_t probe;
+        TLeaf* dim_leaf = leaf->GetLeafCounter(probe);
+        schema.leaves[leaf->GetName()] = {leaf->GetTitle(),
+                                          dim_leaf != nullptr ? dim_leaf->GetName() : "",
+                                          type->second,
+                                          probe};
+    }
+    return schema;
 }
 
 
@@ -78,7 +227,9 @@ void Ranger::TreeCopy(const std::string& tree_in,
         {{"tree_in",          tree_in},
          {"tree_out",         tree_out == "" ? tree_in : tree_out},
          {"branch_selection", branch_selection},
-         {"cut",              cut_selection}},
+         {"cut",              cut_selection},
+         {"engine",           job_engine},
+         {"threads",          std::to_string(job_threads)}},
          Action::copytree});
 }
 
@@ -87,14 +238,23 @@ void Ranger::FlattenTree(const std::string& tree_in,
                          const std::string& branch_selection,
                          const std::string& flat_branch_selection,
                          const std::string& cut_selection,
-                         const std::string& tree_out)
+                         const std::string& tree_out,
+                         const std::string& flatten_mode)
 {
+    if (FlattenModeFromStr.find(flatten_mode) == FlattenModeFromStr.end()) {
+        std::cerr << "\033[07m\033[91m[ERROR]\033[0m Unknown flatten mode \"" << flatten_mode
+                  << "\", use \"zip\", \"cartesian\" or \"split\"\n";
+        exit(1);
+    }
     tree_jobs.push_back({
         {{"tree_in",               tree_in},
          {"tree_out",              tree_out == "" ? tree_in : tree_out},
          {"branch_selection",      branch_selection},
          {"flat_branch_selection", flat_branch_selection},
-         {"cut",                   cut_selection}},
+         {"flatten_mode",          flatten_mode},
+         {"cut",                   cut_selection},
+         {"engine",                job_engine},
+         {"threads",               std::to_string(job_threads)}},
          Action::flatten_tree});
 }
 
@@ -110,7 +270,9 @@ void Ranger::BPVselection(const std::string& tree_in,
          {"tree_out",             tree_out == "" ? tree_in : tree_out},
          {"branch_selection",     branch_selection},
          {"bpv_branch_selection", bpv_branch_selection},
-         {"cut",                  cut_selection}},
+         {"cut",                  cut_selection},
+         {"engine",               job_engine},
+         {"threads",              std::to_string(job_threads)}},
          Action::bpv_selection});
 }
 
@@ -124,6 +286,19 @@ void Ranger::addFormula(const std::string& name, std::string formula)
 }
 
 
+void Ranger::setEngine(const std::string& engine, int n_threads)
+{
+    // Engine is used for all jobs defined afterwards
+    if (engine != "legacy" && engine != "rdf") {
+        std::cerr << "\033[07m\033[91m[ERROR]\033[0m Unknown engine \"" << engine
+                  << "\", use \"legacy\" or \"rdf\"\n";
+        exit(1);
+    }
+    job_engine  = engine;
+    job_threads = std::max(n_threads, 0);
+}
+
+
 void Ranger::dev()
 {
     TFormula f("F", "[0]**2+[1]**2");
@@ -135,8 +310,8 @@ void Ranger::JobValidityCheck(const TreeJob& job)
 {
     // Check whether input path and tree exists in source file
     // Prevents confusing segmentation violation if tree is not found
-    auto inFile = FilePtr(TFile::Open(input_filename, "READ"));
-
+    // Only the first input file is checked, other files are expected
+    // to have the same structure
     if (job.opt.find("tree_in") != job.opt.end()) {
         auto sep = job["tree_in"].rfind('/');
         if (sep != std::string::npos) {
@@ -144,7 +319,7 @@ void Ranger::JobValidityCheck(const TreeJob& job)
             TString dir  = job["tree_in"].substr(0, sep);
             TString tree = job["tree_in"].substr(sep + 1);
 
-            auto treedir = inFile->GetDirectory(dir);
+            auto treedir = input_file->GetDirectory(dir);
             if (treedir == nullptr) {
                 std::cerr << "\033[07m\033[91m[ABORT]\033[0m TDirectory \"" << dir << "\" not found in " << input_filename << '\n';
                 exit(0);
@@ -154,12 +329,11 @@ void Ranger::JobValidityCheck(const TreeJob& job)
                 exit(0);
             }
         }
-        else if (inFile->FindKey(job("tree_in")) == nullptr) {
+        else if (input_file->FindKey(job("tree_in")) == nullptr) {
             std::cerr << "\033[07m\033[91m[ABORT]\033[0m TTree \"" << job("tree_in") << "\" not found in " << input_filename << '\n';
             exit(0);
         }
     }
-    inFile->Close();
 }
 
 
@@ -177,14 +351,39 @@ void Ranger::Run(const std::string& output_filename)
 
     initTmpFilename(output_filename);
 
-    auto temporary_file = FilePtr(TFile::Open(temporary_file_name, "RECREATE"));
-    temporary_file->Close();
+    if (splitting()) {
+        // Chunks are not appended to, and the unsplit output file is removed after Run()
+        TString first_chunk = outfile_name(0, outfile_name.Length() - 5) + "_0001.root";
+        if (!gSystem->AccessPathName(outfile_name) || !gSystem->AccessPathName(first_chunk)) {
+            std::cerr << "\033[07m\033[91m[ERROR]\033[0m " << outfile_name << " or its chunks exist already,"
+                      << " split outputs cannot be appended to\n";
+            exit(1);
+        }
+    }
+
+    // Output and temporary file stay open for all jobs
+    output_file    = FilePtr(TFile::Open(outfile_name, "UPDATE"));
+    temporary_file = FilePtr(TFile::Open(temporary_file_name, "RECREATE"));
+    if (output_file == nullptr || !output_file->IsOpen()) {
+        std::cerr << "\033[07m\033[91m[ERROR]\033[0m Cannot open output file " << outfile_name << '\n';
+        exit(1);
+    }
+    if (splitting()) {
+        chunk_files.clear();
+        split_manifest.open(std::string(outfile_name(0, outfile_name.Length() - 5)) + "_manifest.txt");
+        split_manifest << "# file tree first_entry n_entries\n";
+    }
 
     // Loop over tree jobs
     for (auto& tree_job : tree_jobs) {
 
         JobValidityCheck(tree_job);
 
+        if (useDataFrame(tree_job)) {
+            DataFrameJob(tree_job);
+            continue;
+        }
+
         switch (tree_job.action) {
             case Action::copytree:      SimpleCopy(tree_job);      break;
             case Action::flatten_tree:  flattenTree(tree_job);     break;
@@ -196,8 +395,376 @@ void Ranger::Run(const std::string& output_filename)
         }
         clearLeafBuffers();
     }
+    closeFile(output_file.get());
+    closeFile(temporary_file.get());
+    output_file.reset();
+    temporary_file.reset();
     // Delete temporary file from disk
     remove(temporary_file_name);
+
+    if (splitting()) {
+        // All trees are in the chunk files
+        split_manifest.close();
+        remove(outfile_name);
+    }
+}
+
+
+void Ranger::setOutputSplitting(Long64_t max_entries, Long64_t max_bytes)
+{
+    split_max_entries = std::max(max_entries, 0LL);
+    split_max_bytes   = std::max(max_bytes,   0LL);
+}
+
+
+void Ranger::setOutputSorting(const std::string& major, const std::string& minor, size_t memory_budget)
+{
+    sort_major         = major;
+    sort_minor         = minor.empty() ? "0" : minor;
+    sort_memory_budget = memory_budget;
+}
+
+
+std::pair<long double, long double> Ranger::readSortKey(TLeaf* major, TLeaf* minor)
+{
+    return std::make_pair(major->GetValueLongDouble(), minor != nullptr ? minor->GetValueLongDouble() : 0.0L);
+}
+
+
+bool Ranger::writeSorted(TTree* source, const std::string& tree_name, const std::string& cut)
+{
+    // Writes the entries of source that pass cut sorted by key to the output file or its chunks
+    // (external merge sort). Runs of entries fitting into the memory budget are copied into an
+    // in-memory tree and written in key order to the temporary file, a single run is written to
+    // the output directly. All clones are made from source, such that they share its buffers. Runs are combined by k-way merges, where the number of runs merged at
+    // once is limited such that their read baskets fit into the budget. Equal keys keep their
+    // entry order. Sorted trees get a TTreeIndex of (major, minor).
+    // Returns false if the sort key is not written to the output tree
+    bool has_minor = sort_minor != "0";
+    for (const auto& key : {sort_major, sort_minor}) {
+        if ((key == sort_major || has_minor)
+            && (source->GetLeaf(key.c_str()) == nullptr || !source->GetBranchStatus(key.c_str()))) {
+            std::cout << "\033[07m\033[93m[WARNING]\033[0m Tree " << tree_name << " has no sort key "
+                      << key << ", not sorted\n";
+            return false;
+        }
+    }
+
+    TEntryList* selection = selectEntries(source, cut, tree_name);
+    Long64_t n_entries = selection != nullptr ? selection->GetN() : source->GetEntries();
+
+    TTree* current_tree = source->GetTree();
+    double bytes_per_entry = current_tree->GetEntries() > 0
+                           ? double(current_tree->GetTotBytes()) / current_tree->GetEntries() : 0.0;
+    using SortKey = std::tuple<long double, long double, Long64_t>;
+    Long64_t run_length = std::max<Long64_t>(1, sort_memory_budget / (bytes_per_entry + sizeof(SortKey)));
+    Long64_t n_runs = std::max<Long64_t>(1, (n_entries + run_length - 1) / run_length);
+
+    std::cout << "Sorting tree " << tree_name << " by " << sort_major
+              << (has_minor ? ", " + sort_minor : "") << " in " << n_runs << " runs\n";
+
+    // Sorted entries are filled into sorted_tree or into chunks of the split output.
+    // All trees share the branch addresses of source
+    TTree* sorted_tree = nullptr;
+    OutputChunk chunk;
+    chunk.tree_name   = tree_name;
+    chunk.build_index = true;
+    if (!splitting()) {
+        output_file->cd();
+        sorted_tree = source->CloneTree(0);
+        sorted_tree->SetName(tree_name.c_str());
+        sorted_tree->SetDirectory(output_file.get());
+    }
+    auto fillSorted = [&]() {
+        if (sorted_tree != nullptr) {
+            sorted_tree->Fill();
+        }
+        else {
+            fillChunk(chunk, source);
+        }
+    };
+
+    // Key leaves of the currently loaded tree of a chain
+    TLeaf* major = nullptr;
+    TLeaf* minor = nullptr;
+    int tree_number = -1;
+
+    std::vector<TTree*> runs;
+    for (Long64_t r = 0; r < n_runs; ++r) {
+        auto run_begin = r * run_length;
+        auto run_end   = std::min(run_begin + run_length, n_entries);
+        TTree* run_memory = source->CloneTree(0);
+        run_memory->SetDirectory(nullptr);
+
+        std::vector<SortKey> keys;
+        keys.reserve(run_end - run_begin);
+        for (auto i = run_begin; i < run_end; ++i) {
+            source->GetEntry(selection != nullptr ? source->GetEntryNumber(i) : i);
+            if (source->GetTreeNumber() != tree_number) {
+                tree_number = source->GetTreeNumber();
+                major = source->GetLeaf(sort_major.c_str());
+                minor = has_minor ? source->GetLeaf(sort_minor.c_str()) : nullptr;
+            }
+            run_memory->Fill();
+            auto sort_key = readSortKey(major, minor);
+            keys.emplace_back(sort_key.first, sort_key.second, i - run_begin);
+        }
+        std::sort(keys.begin(), keys.end());
+
+        TTree* run = nullptr;
+        if (n_runs > 1) {
+            temporary_file->cd();
+            run = source->CloneTree(0);
+            run->SetName((tree_name + "_ROOTRANGER_RUN" + std::to_string(r)).c_str());
+            run->SetDirectory(temporary_file.get());
+        }
+        for (const auto& sort_key : keys) {
+            run_memory->GetEntry(std::get<2>(sort_key));
+            if (run != nullptr) {
+                run->Fill();
+            }
+            else {
+                fillSorted();
+            }
+        }
+        delete run_memory;
+        if (run != nullptr) {
+            run->Write("", TObject::kOverwrite);
+            run->DropBaskets();
+            runs.push_back(run);
+        }
+    }
+    clearSelection(source, selection);
+
+    if (!runs.empty()) {
+        // Every run being merged holds one read basket per branch
+        Long64_t basket_bytes = 0;
+        for (const auto& obj : *runs.front()->GetListOfBranches()) {
+            basket_bytes += static_cast<TBranch*>(obj)->GetBasketSize();
+        }
+        size_t fan_in = std::max<size_t>(2, sort_memory_budget / std::max<Long64_t>(basket_bytes, 1));
+
+        // Intermediate passes until all runs fit into one merge
+        int pass = 0;
+        while (runs.size() > fan_in) {
+            std::vector<TTree*> merged_runs;
+            for (size_t first = 0; first < runs.size(); first += fan_in) {
+                std::vector<TTree*> group(runs.begin() + first, runs.begin() + std::min(runs.size(), first + fan_in));
+                temporary_file->cd();
+                TTree* merged = source->CloneTree(0);
+                merged->SetName((tree_name + "_ROOTRANGER_PASS" + std::to_string(pass)
+                                 + "_RUN" + std::to_string(merged_runs.size())).c_str());
+                merged->SetDirectory(temporary_file.get());
+                mergeRuns(group, source, [&]() { merged->Fill(); });
+                merged->Write("", TObject::kOverwrite);
+                merged->DropBaskets();
+                merged_runs.push_back(merged);
+                for (auto run : group) {
+                    temporary_file->Delete((std::string(run->GetName()) + ";*").c_str());
+                    delete run;
+                }
+            }
+            runs = std::move(merged_runs);
+            ++pass;
+        }
+        mergeRuns(runs, source, fillSorted);
+        for (auto run : runs) {
+            temporary_file->Delete((std::string(run->GetName()) + ";*").c_str());
+            delete run;
+        }
+    }
+
+    if (sorted_tree != nullptr) {
+        sorted_tree->BuildIndex(sort_major.c_str(), sort_minor.c_str());
+        output_file->cd();
+        sorted_tree->Write("", TObject::kOverwrite);
+        delete sorted_tree;
+    }
+    else {
+        finishChunks(chunk, source);
+    }
+    return true;
+}
+
+
+void Ranger::mergeRuns(const std::vector<TTree*>& runs, TTree* source, const std::function<void()>& fill)
+{
+    // K-way merge of sorted runs, heads of all runs in a priority queue.
+    // The entry of the smallest head is loaded into the branch buffers of source and filled
+    using Head = std::tuple<long double, long double, size_t>;
+    std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+    std::vector<Long64_t> positions(runs.size(), 0);
+    std::vector<TLeaf*> run_major(runs.size()), run_minor(runs.size(), nullptr);
+    auto readHead = [&](size_t r) {
+        run_major[r]->GetBranch()->GetEntry(positions[r]);
+        if (run_minor[r] != nullptr) {
+            run_minor[r]->GetBranch()->GetEntry(positions[r]);
+        }
+        auto sort_key = readSortKey(run_major[r], run_minor[r]);
+        heads.emplace(sort_key.first, sort_key.second, r);
+    };
+    for (size_t r = 0; r < runs.size(); ++r) {
+        source->CopyAddresses(runs[r]);
+        run_major[r] = runs[r]->GetLeaf(sort_major.c_str());
+        run_minor[r] = sort_minor != "0" ? runs[r]->GetLeaf(sort_minor.c_str()) : nullptr;
+        if (runs[r]->GetEntries() > 0) {
+            readHead(r);
+        }
+    }
+    while (!heads.empty()) {
+        auto r = std::get<2>(heads.top());
+        heads.pop();
+        runs[r]->GetEntry(positions[r]);
+        fill();
+        if (++positions[r] < runs[r]->GetEntries()) {
+            readHead(r);
+        }
+    }
+}
+
+
+bool Ranger::splitting() const
+{
+    return split_max_entries > 0 || split_max_bytes > 0;
+}
+
+
+bool Ranger::chunkFull(TTree* chunk_tree) const
+{
+    // Called after every fill. The entry limit is exact. The byte limit is checked at cluster
+    // boundaries, a chunk is closed if one more cluster of the same compressed size exceeds it.
+    // Before the first cluster is written, the compressed size is unknown and the uncompressed
+    // size is compared to the limit instead
+    auto n_entries = chunk_tree->GetEntries();
+    if (split_max_entries > 0 && n_entries >= split_max_entries) {
+        return true;
+    }
+    if (split_max_bytes <= 0) {
+        return false;
+    }
+    auto cluster_size = chunk_tree->GetAutoFlush();
+    if (cluster_size <= 0) {
+        return chunk_tree->GetTotBytes() >= split_max_bytes;
+    }
+    if (n_entries % cluster_size != 0) {
+        return false;
+    }
+    double bytes_per_entry = double(chunk_tree->GetZipBytes()) / n_entries;
+    return (n_entries + cluster_size) * bytes_per_entry > split_max_bytes;
+}
+
+
+void Ranger::openChunk(OutputChunk& chunk, TTree* source)
+{
+    // Chunk i of every tree is written to <output>_000i.root
+    char suffix[16];
+    snprintf(suffix, sizeof(suffix), "_%04zu.root", ++chunk.index);
+    std::string chunk_name = std::string(outfile_name(0, outfile_name.Length() - 5)) + suffix;
+
+    chunk.file = FilePtr(TFile::Open(TString(chunk_name), chunk_files.count(chunk_name) ? "UPDATE" : "RECREATE"));
+    if (chunk.file == nullptr || !chunk.file->IsOpen()) {
+        std::cerr << "\033[07m\033[91m[ERROR]\033[0m Cannot open output file " << chunk_name << '\n';
+        exit(1);
+    }
+    chunk_files.insert(chunk_name);
+    chunk.file->cd();
+    chunk.tree = source->CloneTree(0);
+    chunk.tree->SetName(chunk.tree_name.c_str());
+    chunk.tree->SetDirectory(chunk.file.get());
+}
+
+
+void Ranger::fillChunk(OutputChunk& chunk, TTree* source)
+{
+    // Fills the current entry of source, which shares its branch addresses with the chunk tree
+    if (chunk.tree == nullptr) {
+        openChunk(chunk, source);
+    }
+    chunk.tree->Fill();
+    if (chunkFull(chunk.tree)) {
+        closeChunk(chunk);
+    }
+}
+
+
+void Ranger::closeChunk(OutputChunk& chunk)
+{
+    for (const auto& formula : chunk.formulas) {
+        addFormulaBranch(chunk.tree, formula.first, formula.second);
+    }
+    if (chunk.build_index) {
+        chunk.tree->BuildIndex(sort_major.c_str(), sort_minor.c_str());
+    }
+    chunk.file->cd();
+    chunk.tree->Write("", TObject::kOverwrite);
+
+    auto n_entries = chunk.tree->GetEntries();
+    split_manifest << chunk.file->GetName() << ' ' << chunk.tree_name << ' '
+                   << chunk.first_entry << ' ' << n_entries << '\n';
+    chunk.first_entry += n_entries;
+
+    delete chunk.tree;
+    chunk.tree = nullptr;
+    chunk.file->Close();
+    chunk.file.reset();
+}
+
+
+void Ranger::finishChunks(OutputChunk& chunk, TTree* source)
+{
+    // Writes the last chunk, an empty tree is written as a single empty chunk
+    if (chunk.tree == nullptr && chunk.index == 0) {
+        openChunk(chunk, source);
+    }
+    if (chunk.tree != nullptr) {
+        closeChunk(chunk);
+    }
+    std::cout << "Wrote tree " << chunk.tree_name << " into " << chunk.index << " chunks\n";
+}
+
+
+void Ranger::writeChunks(TTree* source, const std::string& tree_name, const std::string& cut,
+                         const std::vector<std::pair<std::string, std::string>>& formulas)
+{
+    // Fills the entries of source that pass cut directly into chunk files
+    OutputChunk chunk;
+    chunk.tree_name = tree_name;
+    chunk.formulas  = formulas;
+
+    TEntryList* selection = selectEntries(source, cut, tree_name);
+    Long64_t n_entries = selection != nullptr ? selection->GetN() : source->GetEntries();
+    for (Long64_t i = 0; i < n_entries; ++i) {
+        source->GetEntry(selection != nullptr ? source->GetEntryNumber(i) : i);
+        fillChunk(chunk, source);
+    }
+    finishChunks(chunk, source);
+    clearSelection(source, selection);
+}
+
+
+TEntryList* Ranger::selectEntries(TTree* source, const std::string& cut, const std::string& tree_name)
+{
+    // Evaluates cut into an entry list, which is set on source. Returns nullptr without cut
+    if (cut.empty()) {
+        return nullptr;
+    }
+    gROOT->cd();
+    if (source->Draw(">>ranger_selection", cut.c_str(), "entrylist") < 0) {
+        std::cerr << "\033[07m\033[91m[ERROR]\033[0m Invalid cut \"" << cut << "\" on " << tree_name << '\n';
+        exit(1);
+    }
+    auto selection = static_cast<TEntryList*>(gROOT->FindObject("ranger_selection"));
+    source->SetEntryList(selection);
+    return selection;
+}
+
+
+void Ranger::clearSelection(TTree* source, TEntryList* selection)
+{
+    if (selection != nullptr) {
+        source->SetEntryList(nullptr);
+        delete selection;
+    }
 }
 
 
@@ -227,10 +794,114 @@ void Ranger::reset()
 }
 
 
+std::string Ranger::hiddenSiblingName(const std::string& target, const std::string& tag)
+{
+    auto sep = target.rfind('/');
+    std::string dir      = (sep != std::string::npos) ? target.substr(0, sep + 1) : "";
+    std::string filename = (sep != std::string::npos) ? target.substr(sep + 1) : target;
+    static std::mt19937 generator(std::random_device{}());
+    std::uniform_int_distribution<std::mt19937::result_type> distribution;
+    return dir + '.' + std::to_string(distribution(generator)) + '_' + tag + '_' + filename;
+}
+
+
+bool Ranger::mergeFiles(const std::vector<std::string>& inputs, const std::string& target, bool fast)
+{
+    // Fast method copies compressed baskets, trees are not re-encoded
+    TFileMerger merger(kFALSE, kFALSE);
+    merger.SetPrintLevel(0);
+    merger.SetFastMethod(fast);
+    if (!merger.OutputFile(target.c_str(), "RECREATE")) {
+        return false;
+    }
+    for (const auto& input : inputs) {
+        if (!merger.AddFile(input.c_str(), kFALSE)) {
+            return false;
+        }
+    }
+    return merger.Merge();
+}
+
+
+void Ranger::Merge(const std::vector<std::string>& outputs,
+                   const std::string& target,
+                   int n_threads,
+                   int fan_in,
+                   bool recluster)
+{
+    // Merges files with identical tree structure (i.e. outputs of Run()) into target.
+    // Files are merged as a tree reduction: each level merges groups of fan_in files
+    // in parallel into hidden intermediate files, until one group is left, which is
+    // merged into target. Fast merging keeps the (small) clusters of the inputs; with
+    // recluster, the last level re-encodes all entries into clusters of the target.
+    if (outputs.empty()) {
+        std::cerr << "\033[07m\033[91m[ERROR]\033[0m No files to merge into " << target << '\n';
+        exit(1);
+    }
+    fan_in = std::max(fan_in, 2);
+    if (n_threads <= 0) {
+        n_threads = std::max(1u, std::thread::hardware_concurrency());
+    }
+    ROOT::EnableThreadSafety();
+
+    std::cout << "Merging " << outputs.size() << " files into " << target << '\n';
+
+    std::vector<std::string> level = outputs;
+    std::vector<std::string> intermediate; // Files created by previous level
+    int depth = 0;
+
+    while (level.size() > static_cast<size_t>(fan_in)) {
+        std::vector<std::vector<std::string>> groups;
+        std::vector<std::string> next_level;
+        for (size_t first = 0; first < level.size(); first += fan_in) {
+            auto last = std::min(level.size(), first + fan_in);
+            groups.emplace_back(level.begin() + first, level.begin() + last);
+            next_level.push_back(hiddenSiblingName(target, "merge" + std::to_string(depth)));
+        }
+
+        std::vector<char> success(groups.size(), 0);
+        std::atomic<size_t> next_group(0);
+        std::vector<std::thread> workers;
+        for (int t = 0; t < std::min<int>(n_threads, groups.size()); ++t) {
+            workers.emplace_back([&]() {
+                for (size_t g = next_group++; g < groups.size(); g = next_group++) {
+                    success[g] = mergeFiles(groups[g], next_level[g]);
+                }
+            });
+        }
+        for (auto& worker : workers) {
+            worker.join();
+        }
+
+        for (const auto& file : intermediate) {
+            remove(file.c_str());
+        }
+        if (contains(success, char(0))) {
+            for (const auto& file : next_level) {
+                remove(file.c_str());
+            }
+            std::cerr << "\033[07m\033[91m[ERROR]\033[0m Merging into " << target << " failed\n";
+            exit(1);
+        }
+        intermediate = next_level;
+        level = std::move(next_level);
+        ++depth;
+    }
+
+    bool merged = mergeFiles(level, target, !recluster);
+    for (const auto& file : intermediate) {
+        remove(file.c_str());
+    }
+    if (!merged) {
+        std::cerr << "\033[07m\033[91m[ERROR]\033[0m Merging into " << target << " failed\n";
+        exit(1);
+    }
+}
+
+
 void Ranger::AddBranchesAndCuts(const TreeJob& tree_job, TTree* temp_tree, bool skipcut)
 {
     // Add formula branches, apply cuts, write to file, Create final tree
-    auto outFile = FilePtr(TFile::Open(outfile_name, "UPDATE"));
     TTree* write_tree = nullptr;
 
     if (!formula_buffer.empty()) {
@@ -240,17 +911,32 @@ void Ranger::AddBranchesAndCuts(const TreeJob& tree_job, TTree* temp_tree, bool
         formula_buffer.clear();
     }
 
+    std::string cut = skipcut ? "" : tree_job["cut"];
+    if (!sort_major.empty() && writeSorted(temp_tree, tree_job["tree_out"], cut)) {
+        return;
+    }
+    if (splitting()) {
+        writeChunks(temp_tree, tree_job["tree_out"], cut, {});
+        return;
+    }
+
+    output_file->cd();
     if (!tree_job["cut"].empty() && !skipcut) {
         write_tree = temp_tree->CopyTree(tree_job("cut"));
+        if (write_tree == nullptr) {
+            std::cerr << "\033[07m\033[91m[ERROR]\033[0m Invalid cut \"" << tree_job["cut"] << "\" on "
+                      << tree_job["tree_in"] << '\n';
+            exit(1);
+        }
         write_tree->SetName(tree_job("tree_out"));
     }
     else {
         write_tree = temp_tree->CloneTree();
         write_tree->SetName(tree_job("tree_out"));
     }
-    outFile->Delete(TString(temp_tree->GetName()) + ";*");
+    output_file->Delete(TString(temp_tree->GetName()) + ";*");
     write_tree->Write("", TObject::kOverwrite);
-    outFile->Close();
+    delete write_tree;
 }
 
 
@@ -258,14 +944,13 @@ void Ranger::SimpleCopy(TreeJob& tree_job)
 {
     // Copy tree with cut selection and branch selection using built-in methods
     std::cout << "Copying tree " << tree_job["tree_in"] << '\n';
-    auto inFile = FilePtr(TFile::Open(input_filename, "READ"));
-    TTree* input_tree = static_cast<TTree*>(inFile->Get(tree_job("tree_in")));
+    auto input_tree = getInputTree(tree_job);
+    TString input_tree_name = input_tree->GetName();
 
     // Change tree name so that it is not accidentally deleted afterwards
     input_tree->SetName(tree_job("tree_in") + "_ROOTRANGER_COPY_SOURCE");
 
-    auto outFile = FilePtr(TFile::Open(outfile_name, "UPDATE"));
-    outFile->cd();
+    output_file->cd();
 
     if (!tree_job["branch_selection"].empty()) {
         input_tree->SetBranchStatus("*", 0);
@@ -278,9 +963,34 @@ void Ranger::SimpleCopy(TreeJob& tree_job)
     else {
         input_tree->SetBranchStatus("*", 1);
     }
+    if ((!tree_job["cut"].empty() || !sort_major.empty()) && !formula_buffer.empty()) {
+        // Cut or sort key may use formula branches, which are added to a full copy first
+        temporary_file->cd();
+        TTree* temp_tree = input_tree->CloneTree();
+        temp_tree->SetTitle("root_ranger_tree");
+        AddBranchesAndCuts(tree_job, temp_tree);
+        delete temp_tree;
+        input_tree->SetName(input_tree_name);
+        return;
+    }
+    if (!sort_major.empty() && writeSorted(input_tree, tree_job["tree_out"], tree_job["cut"])) {
+        input_tree->SetName(input_tree_name);
+        return;
+    }
+    if (splitting()) {
+        writeChunks(input_tree, tree_job["tree_out"], tree_job["cut"], formula_buffer);
+        formula_buffer.clear();
+        input_tree->SetName(input_tree_name);
+        return;
+    }
     TTree* output_tree = nullptr;
     if (!tree_job["cut"].empty()) {
         output_tree = input_tree->CopyTree(tree_job("cut"));
+        if (output_tree == nullptr) {
+            std::cerr << "\033[07m\033[91m[ERROR]\033[0m Invalid cut \"" << tree_job["cut"] << "\" on "
+                      << tree_job["tree_in"] << '\n';
+            exit(1);
+        }
     }
     else {
         output_tree = input_tree->CloneTree();
@@ -295,10 +1005,10 @@ void Ranger::SimpleCopy(TreeJob& tree_job)
 
     output_tree->SetName(tree_job("tree_out"));
     output_tree->SetTitle("root_ranger_tree");
-    outFile->Delete(TString(input_tree->GetName()) + ";*");
+    output_file->Delete(TString(input_tree->GetName()) + ";*");
     output_tree->Write("", TObject::kOverwrite);
-    outFile->Close();
-    inFile->Close();
+    delete output_tree;
+    input_tree->SetName(input_tree_name);
 }
 
 
@@ -308,10 +1018,9 @@ void Ranger::BestPVSelection(TreeJob& tree_job)
     // If TLeaf entries are arrays, select first
     std::cout << "BPV selection on " << tree_job["tree_in"] << '\n';
 
-    auto inputFile = FilePtr(TFile::Open(input_filename, "READ"));
-    TTree* input_tree = static_cast<TTree*>(inputFile->Get(tree_job("tree_in")));
+    auto input_tree = getInputTree(tree_job);
 
-    auto temporary_file = FilePtr(TFile::Open(temporary_file_name, "UPDATE"));
+    temporary_file->cd();
     TTree output_tree(tree_job("tree_out") + "_ROOTRANGER_BPV", "root_ranger_tree");
 
     input_tree->SetBranchStatus("*", 0);
@@ -321,29 +1030,235 @@ void Ranger::BestPVSelection(TreeJob& tree_job)
     getListOfBranchesBySelection(all_leaves, input_tree, tree_job["branch_selection"]);
     getListOfBranchesBySelection(bpv_leaves, input_tree, tree_job["bpv_branch_selection"]);
 
-    analyzeLeaves_FillLeafBuffers(input_tree, &output_tree, all_leaves, bpv_leaves);
+    int n_groups = analyzeLeaves_FillLeafBuffers(input_tree, getTreeSchema(tree_job, input_tree),
+                                                 all_leaves, bpv_leaves).size();
+    bookOutputBranches(&output_tree);
 
-    auto n_entries = input_tree->GetEntriesFast();
-
-    // Event loop
-    for (auto event = 0; event < n_entries; ++event) {
-        input_tree->GetEntry(event);
-        output_tree.Fill();
+    // Schema-specialized event loop, if enabled
+    std::vector<void*> jit_slots;
+    auto jit_loop = jit_enabled ? getCompiledEventLoop({}, false, jit_slots) : nullptr;
+    if (jit_loop != nullptr) {
+        jit_loop(input_tree, &output_tree, jit_slots.data(), nullptr);
+    }
+    else {
+        auto n_entries = input_tree->GetEntries();
+
+        // Event loop
+        for (Long64_t event = 0; event < n_entries; ++event) {
+            input_tree->GetEntry(event);
+            // Select first array element
+            for (int group = 0; group < n_groups; ++group) {
+                incrementBuffers(0, group);
+            }
+            output_tree.Fill();
+        }
     }
     output_tree.Write("", TObject::kOverwrite);
     AddBranchesAndCuts(tree_job, &output_tree);
-    temporary_file->Close();
-    inputFile->Close();
 }
 
 
-void Ranger::flattenTree(const TreeJob& tree_job)
+bool Ranger::useDataFrame(const TreeJob& tree_job)
 {
-    auto inFile = FilePtr(TFile::Open(input_filename, "READ"));
-    TTree* input_tree = static_cast<TTree*>(inFile->Get(tree_job("tree_in")));
+    // Checks whether job should and can be expressed as RDataFrame graph.
+    // Otherwise the event loop is used
+    auto engine = tree_job.opt.find("engine");
+    if (engine == tree_job.opt.end() || engine->second != "rdf") {
+        return false;
+    }
+    std::string reason;
+    if (tree_job.action == Action::flatten_tree) {
+        reason = "flattening changes the number of entries";
+    }
+    if (splitting()) {
+        reason = "the output is split into chunks while writing";
+    }
+    if (!sort_major.empty()) {
+        reason = "the output is sorted while writing";
+    }
+    for (const auto& formula : formula_buffer) {
+        if (formulaToCpp(formula.second).empty()) {
+            reason = "formula \"" + formula.second + "\" cannot be translated";
+        }
+    }
+    if (!tree_job["cut"].empty()) {
+        if (formulaToCpp(tree_job["cut"]).empty()) {
+            reason = "cut \"" + tree_job["cut"] + "\" cannot be translated";
+        }
+        else {
+            // TTreeFormula loops over array leaves in cuts, RDataFrame filters need a single value
+            const TreeSchema& schema = getTreeSchema(tree_job, getInputTree(tree_job));
+            std::string cut = tree_job["cut"];
+            std::regex name_search(R"([A-Za-z_]\w*)");
+            for (auto it = std::sregex_iterator(cut.begin(), cut.end(), name_search); it != std::sregex_iterator(); ++it) {
+                auto ls = schema.leaves.find(it->str());
+                if (ls != schema.leaves.end() && (!ls->second.array_length_leaf.empty() || ls->second.probe > 1)) {
+                    reason = "cut uses array leaf " + it->str();
+                }
+            }
+        }
+    }
+    if (tree_job.action == Action::bpv_selection) {
+        TTree* input_tree = getInputTree(tree_job);
+        const TreeSchema& schema = getTreeSchema(tree_job, input_tree);
+        std::vector<TLeaf*> bpv_leaves;
+        getListOfBranchesBySelection(bpv_leaves, input_tree, tree_job["bpv_branch_selection"]);
+        for (const auto& leaf : bpv_leaves) {
+            auto ls = schema.leaves.find(leaf->GetName());
+            if (ls != schema.leaves.end() && !ls->second.array_length_leaf.empty() && ls->second.probe > 1) {
+                reason = std::string("leaf ") + leaf->GetName() + " has more than one dimension";
+            }
+        }
+    }
+    if (!reason.empty()) {
+        std::cout << "\033[07m\033[93m[WARNING]\033[0m Using event loop for " << tree_job["tree_in"]
+                  << " since " << reason << '\n';
+        return false;
+    }
+    return true;
+}
+
+
+std::string Ranger::formulaToCpp(std::string formula)
+{
+    // Translates TFormula or TTreeFormula expression to C++ expression. Removes '#' from
+    // branch names and replaces a**b by pow(a,b). Returns empty string if not possible,
+    // e.g. for '^' or TTreeFormula functions like Sum$ and Length$
+    if (contains(formula, '^') || contains(formula, '$')) {
+        return "";
+    }
+    formula.erase(std::remove(formula.begin(), formula.end(), '#'), formula.end());
+    formula.erase(std::remove(formula.begin(), formula.end(), ' '), formula.end());
+
+    auto is_name = [](char c) { return std::isalnum(c) || c == '_' || c == '.' || c == ':'; };
+
+    for (auto op = formula.find("**"); op != std::string::npos; op = formula.find("**")) {
+        // Left operand: name, number or parenthesized expression with optional function name
+        auto begin = op;
+        if (begin > 0 && formula[begin - 1] == ')') {
+            int depth = 0;
+            do {
+                --begin;
+                depth += (formula[begin] == ')') - (formula[begin] == '(');
+            } while (begin > 0 && depth > 0);
+            if (depth > 0) {
+                return "";
+            }
+        }
+        while (begin > 0 && is_name(formula[begin - 1])) {
+            --begin;
+        }
+        // Right operand: signed name, number or function call
+        auto end = op + 2;
+        if (end < formula.size() && (formula[end] == '-' || formula[end] == '+')) {
+            ++end;
+        }
+        while (end < formula.size() && is_name(formula[end])) {
+            ++end;
+        }
+        if (end < formula.size() && formula[end] == '(') {
+            int depth = 0;
+            do {
+                depth += (formula[end] == '(') - (formula[end] == ')');
+                ++end;
+            } while (end < formula.size() && depth > 0);
+            if (depth > 0) {
+                return "";
+            }
+        }
+        if (begin == op || end == op + 2) {
+            return "";
+        }
+        formula = formula.substr(0, begin) + "pow(" + formula.substr(begin, op - begin) + ','
+                + formula.substr(op + 2, end - op - 2) + ')' + formula.substr(end);
+    }
+    return formula;
+}
+
+
+void Ranger::DataFrameJob(TreeJob& tree_job)
+{
+    // Runs copy and bpv jobs including cuts and formulas as RDataFrame graph.
+    // Only the selected branches are read, entry ranges are processed in parallel if
+    // implicit multithreading is enabled.
+    // Formulas are evaluated before the cut, as in the event loop
+    std::cout << "RDataFrame " << (tree_job.action == Action::copytree ? "copy of " : "BPV selection on ")
+              << tree_job["tree_in"] << '\n';
+
+    // Implicit multithreading of this job, must be set before the RDataFrame is created.
+    // The previous state of the process is restored afterwards
+    bool mt_enabled = ROOT::IsImplicitMTEnabled();
+    unsigned mt_pool_size = mt_enabled ? ROOT::GetThreadPoolSize() : 0;
+    int n_threads = std::stoi(tree_job["threads"]);
+    if (mt_enabled) {
+        ROOT::DisableImplicitMT();
+    }
+    if (n_threads != 1) {
+        ROOT::EnableImplicitMT(n_threads);
+    }
+
+    TTree* input_tree = getInputTree(tree_job);
+    const TreeSchema& schema = getTreeSchema(tree_job, input_tree);
+
+    std::vector<TLeaf*> leaves, bpv_leaves;
+    auto branch_selection = tree_job["branch_selection"];
+    getListOfBranchesBySelection(leaves, input_tree, branch_selection.empty() ? "*" : branch_selection);
+    if (tree_job.action == Action::bpv_selection) {
+        getListOfBranchesBySelection(bpv_leaves, input_tree, tree_job["bpv_branch_selection"]);
+    }
+
+    ROOT::RDataFrame frame(*input_tree);
+    ROOT::RDF::RNode node = frame;
+    std::vector<std::string> columns;
+
+    for (const auto& leaf : leaves) {
+        std::string name = leaf->GetName();
+        auto ls = schema.leaves.find(name);
+        if (ls == schema.leaves.end()) {
+            continue;
+        }
+        if (!ls->second.array_length_leaf.empty() && contains(bpv_leaves, leaf)) {
+            // Select first array element
+            std::string type = leaf->GetTypeName();
+            node = node.Define(name + "_flat", name + ".empty() ? " + type + "(0) : " + name + "[0]");
+            columns.push_back(name + "_flat");
+        }
+        else {
+            columns.push_back(name);
+        }
+    }
+    for (const auto& formula : formula_buffer) {
+        node = node.Define(formula.first, "static_cast<Double_t>(" + formulaToCpp(formula.second) + ')');
+        columns.push_back(formula.first);
+    }
+    formula_buffer.clear();
+
+    if (!tree_job["cut"].empty()) {
+        node = node.Filter(formulaToCpp(tree_job["cut"]));
+    }
+
+    // Snapshot opens the output file itself
+    closeFile(output_file.get());
+
+    ROOT::RDF::RSnapshotOptions options;
+    options.fMode = "UPDATE";
+    options.fOverwriteIfExists = true;
+    node.Snapshot(tree_job["tree_out"], std::string(outfile_name), columns, options);
 
-    auto temporary_file = FilePtr(TFile::Open(temporary_file_name, "UPDATE"));
-    TTree output_tree(tree_job("tree_out") + "_ROOTRANGER_FLAT", "root_ranger_tree");
+    output_file = FilePtr(TFile::Open(outfile_name, "UPDATE"));
+
+    if (n_threads != 1) {
+        ROOT::DisableImplicitMT();
+    }
+    if (mt_enabled) {
+        ROOT::EnableImplicitMT(mt_pool_size);
+    }
+}
+
+
+void Ranger::flattenTree(const TreeJob& tree_job)
+{
+    auto input_tree = getInputTree(tree_job);
 
     input_tree->SetBranchStatus("*", 0);
 
@@ -354,121 +1269,407 @@ void Ranger::flattenTree(const TreeJob& tree_job)
     getListOfBranchesBySelection(all_leaves, input_tree,  tree_job["branch_selection"]);
     getListOfBranchesBySelection(flat_leaves, input_tree, tree_job["flat_branch_selection"]);
 
-    TLeaf* array_length_leaf = analyzeLeaves_FillLeafBuffers(input_tree, &output_tree, all_leaves, flat_leaves);
-
-    // array_length represents array dimension of each element
-    int max_array_length = -1;
-    input_tree->SetBranchStatus(array_length_leaf->GetName(), 1);
-    input_tree->SetBranchAddress(array_length_leaf->GetName(), &max_array_length);
-    // Create new branch containing the current array index of each event
-    int array_elem_it = -1;
-    output_tree.Branch("array_length", &array_elem_it, "array_length/i");
-
-    int n_entries = input_tree->GetEntriesFast();
-    // Event loop
-    for (int event = 0; event < n_entries; ++event) {
-        input_tree->GetEntry(event);
-        array_elem_it = 0;
-        //std::cout << "EVENT " << event << ' ' << max_array_length << '\n';
-        output_tree.Fill();
-        for (array_elem_it = 1; array_elem_it < max_array_length; ++array_elem_it) {
-            // go to next array element
-            incrementBuffer<   Char_t>(array_elem_it);
-            incrementBuffer<  UChar_t>(array_elem_it);
-            incrementBuffer<  Short_t>(array_elem_it);
-            incrementBuffer< UShort_t>(array_elem_it);
-            incrementBuffer<    Int_t>(array_elem_it);
-            incrementBuffer<   UInt_t>(array_elem_it);
-            incrementBuffer< Double_t>(array_elem_it);
-            incrementBuffer<  Float_t>(array_elem_it);
-            incrementBuffer< Long64_t>(array_elem_it);
-            incrementBuffer<ULong64_t>(array_elem_it);
-            output_tree.Fill();
+    // One group of flattened leaves per array length leaf
+    auto array_length_names = analyzeLeaves_FillLeafBuffers(input_tree, getTreeSchema(tree_job, input_tree),
+                                                            all_leaves, flat_leaves);
+    int n_groups = array_length_names.size();
+
+    if (n_groups == 0) {
+        std::cerr << "\033[07m\033[91m[ABORT]\033[0m No leaves with variable array length selected for flattening in "
+                  << tree_job["tree_in"] << '\n';
+        exit(0);
+    }
+    // A single group is flattened in zip mode. Split mode keeps its tree name with counter suffix
+    auto mode = FlattenModeFromStr.find(tree_job["flatten_mode"])->second;
+    if (n_groups == 1 && mode == flatten_cartesian) {
+        mode = flatten_zip;
+    }
+
+    if (n_groups > 1) {
+        std::cout << "Flattening " << n_groups << " array length leaf groups in "
+                  << tree_job["flatten_mode"] << " mode:";
+        for (const auto& name : array_length_names) {
+            std::cout << ' ' << name;
+        }
+        std::cout << '\n';
+    }
+
+    // Current array index and array length of each group
+    std::vector<UInt_t> array_elem_it(n_groups, 0);
+    std::vector<UInt_t> array_length(n_groups, 0);
+
+    // Split mode writes one tree per group, all trees share one input scan
+    std::vector<TreeJob> output_jobs;
+    std::vector<TTree*> output_trees;
+
+    if (mode == flatten_split) {
+        for (const auto& name : array_length_names) {
+            TreeJob group_job = tree_job;
+            group_job.opt["tree_out"] = tree_job["tree_out"] + '_' + name;
+            output_jobs.push_back(group_job);
+        }
+    }
+    else {
+        output_jobs.push_back(tree_job);
+    }
+
+    temporary_file->cd();
+    for (size_t t = 0; t < output_jobs.size(); ++t) {
+        auto output_tree = new TTree(output_jobs[t]("tree_out") + "_ROOTRANGER_FLAT", "root_ranger_tree");
+        if (mode == flatten_split) {
+            bookOutputBranches(output_tree, t);
+            output_tree->Branch("array_length", &array_elem_it[t], "array_length/i");
+        }
+        else if (mode == flatten_cartesian) {
+            bookOutputBranches(output_tree);
+            for (int group = 0; group < n_groups; ++group) {
+                TString index_name = "array_length_" + array_length_names[group];
+                output_tree->Branch(index_name, &array_elem_it[group], index_name + "/i");
+            }
+        }
+        else {
+            // Create new branch containing the current array index of each event
+            bookOutputBranches(output_tree);
+            output_tree->Branch("array_length", &array_elem_it[0], "array_length/i");
+        }
+        output_trees.push_back(output_tree);
+    }
+
+    Long64_t n_skipped = 0;
+
+    // Schema-specialized event loop, if enabled
+    std::vector<void*> jit_slots;
+    auto jit_loop = (jit_enabled && mode == flatten_zip) ? getCompiledEventLoop(array_length_names, true, jit_slots)
+                                                          : nullptr;
+    if (jit_loop != nullptr) {
+        n_skipped = jit_loop(input_tree, output_trees[0], jit_slots.data(), &array_elem_it[0]);
+    }
+    else {
+        // Array length leaves of the currently loaded file of the chain
+        std::vector<TLeaf*> array_length_leaves(n_groups, nullptr);
+        int tree_number = -1;
+
+        Long64_t n_entries = input_tree->GetEntries();
+        // Event loop
+        for (Long64_t event = 0; event < n_entries; ++event) {
+            input_tree->GetEntry(event);
+            if (input_tree->GetTreeNumber() != tree_number) {
+                tree_number = input_tree->GetTreeNumber();
+                for (int group = 0; group < n_groups; ++group) {
+                    array_length_leaves[group] = input_tree->GetLeaf(array_length_names[group].c_str());
+                }
+            }
+            for (int group = 0; group < n_groups; ++group) {
+                array_length[group] = array_length_leaves[group]->GetValue();
+            }
+
+            switch (mode) {
+                case flatten_zip:
+                    if (std::count(array_length.begin(), array_length.end(), array_length[0]) != n_groups) {
+                        ++n_skipped;
+                        break;
+                    }
+                    for (array_elem_it[0] = 0; array_elem_it[0] < array_length[0]; ++array_elem_it[0]) {
+                        // go to next array element
+                        for (int group = 0; group < n_groups; ++group) {
+                            incrementBuffers(array_elem_it[0], group);
+                        }
+                        output_trees[0]->Fill();
+                    }
+                    break;
+                case flatten_split:
+                    for (int group = 0; group < n_groups; ++group) {
+                        for (array_elem_it[group] = 0; array_elem_it[group] < array_length[group]; ++array_elem_it[group]) {
+                            incrementBuffers(array_elem_it[group], group);
+                            output_trees[group]->Fill();
+                        }
+                    }
+                    break;
+                case flatten_cartesian:
+                    fillCartesian(output_trees[0], array_elem_it, array_length);
+                    break;
+            }
         }
     }
+    if (n_skipped > 0) {
+        std::cout << "\033[07m\033[93m[WARNING]\033[0m Skipped " << n_skipped
+                  << " events with different array lengths in zip mode\n";
+    }
+
     temporary_file->Write("", TObject::kOverwrite);
-    AddBranchesAndCuts(tree_job, &output_tree);
-    temporary_file->Close();
-    inFile->Close();
+    // Every output tree receives the pending formulas
+    auto formulas = formula_buffer;
+    for (size_t t = 0; t < output_jobs.size(); ++t) {
+        formula_buffer = formulas;
+        AddBranchesAndCuts(output_jobs[t], output_trees[t]);
+        delete output_trees[t];
+    }
+}
+
+
+void Ranger::setJIT(bool enable, const std::string& cache_dir)
+{
+    jit_enabled   = enable;
+    jit_cache_dir = cache_dir;
+    if (!jit_cache_dir.empty()) {
+        gSystem->mkdir(jit_cache_dir.c_str(), kTRUE);
+    }
+}
+
+
+Ranger::EventLoop Ranger::getCompiledEventLoop(const std::vector<std::string>& array_length_names,
+                                               bool flatten,
+                                               std::vector<void*>& slots)
+{
+    // Generates an event loop specialized to the leaf buffers of the current job.
+    // Flattening loops process all array length groups in zip mode, BPV loops copy
+    // the first array element of all selected leaves. Buffer addresses are passed in
+    // slots, types, strides and array length leaves are fixed in the generated code,
+    // such that element copies can be unrolled and vectorized by the compiler.
+    // The source only depends on the schema, its hash identifies the compiled loop.
+    // Returns nullptr if compilation fails.
+    std::string declarations, copies;
+    for (size_t group = 0; group < std::max<size_t>(array_length_names.size(), 1); ++group) {
+        generateCopies<   Char_t>(declarations, copies, slots, flatten ? group : -1);
+        generateCopies<  UChar_t>(declarations, copies, slots, flatten ? group : -1);
+        generateCopies<  Short_t>(declarations, copies, slots, flatten ? group : -1);
+        generateCopies< UShort_t>(declarations, copies, slots, flatten ? group : -1);
+        generateCopies<    Int_t>(declarations, copies, slots, flatten ? group : -1);
+        generateCopies<   UInt_t>(declarations, copies, slots, flatten ? group : -1);
+        generateCopies<  Float_t>(declarations, copies, slots, flatten ? group : -1);
+        generateCopies< Double_t>(declarations, copies, slots, flatten ? group : -1);
+        generateCopies< Long64_t>(declarations, copies, slots, flatten ? group : -1);
+        generateCopies<ULong64_t>(declarations, copies, slots, flatten ? group : -1);
+    }
+
+    std::string source =
+        "#include \"TTree.h\"\n"
+        "#include \"TLeaf.h\"\n\n"
+        "extern \"C\" Long64_t RANGER_EVENT_LOOP(TTree* input_tree, TTree* output_tree, void** slots, UInt_t* array_elem_it)\n"
+        "{\n" + declarations +
+        "    Long64_t n_skipped = 0;\n"
+        "    Long64_t n_entries = input_tree->GetEntries();\n";
+    if (flatten) {
+        source += "    TLeaf* array_length[" + std::to_string(array_length_names.size()) + "];\n"
+                  "    int tree_number = -1;\n"
+                  "    for (Long64_t event = 0; event < n_entries; ++event) {\n"
+                  "        input_tree->GetEntry(event);\n"
+                  "        if (input_tree->GetTreeNumber() != tree_number) {\n"
+                  "            tree_number = input_tree->GetTreeNumber();\n";
+        for (size_t group = 0; group < array_length_names.size(); ++group) {
+            source += "            array_length[" + std::to_string(group) + "] = input_tree->GetLeaf(\""
+                    + array_length_names[group] + "\");\n";
+        }
+        source += "        }\n"
+                  "        const UInt_t n = array_length[0]->GetValue();\n";
+        for (size_t group = 1; group < array_length_names.size(); ++group) {
+            source += "        if (UInt_t(array_length[" + std::to_string(group) + "]->GetValue()) != n) {\n"
+                      "            ++n_skipped;\n"
+                      "            continue;\n"
+                      "        }\n";
+        }
+        source += "        for (UInt_t k = 0; k < n; ++k) {\n" + copies +
+                  "            *array_elem_it = k;\n"
+                  "            output_tree->Fill();\n"
+                  "        }\n"
+                  "    }\n";
+    }
+    else {
+        source += "    const UInt_t k = 0;\n"
+                  "    for (Long64_t event = 0; event < n_entries; ++event) {\n"
+                  "        input_tree->GetEntry(event);\n" + copies +
+                  "        output_tree->Fill();\n"
+                  "    }\n";
+    }
+    source += "    return n_skipped;\n"
+              "}\n";
+
+    std::stringstream name;
+    name << "ranger_event_loop_" << std::hex << std::hash<std::string>()(source);
+    source = std::regex_replace(source, std::regex("RANGER_EVENT_LOOP"), name.str());
+
+    auto cached = jit_loops.find(name.str());
+    if (cached != jit_loops.end()) {
+        return cached->second;
+    }
+
+    EventLoop loop = nullptr;
+    if (!jit_cache_dir.empty()) {
+        // Shared object is compiled once and reused by later processes
+        std::string macro = jit_cache_dir + '/' + name.str() + ".C";
+        if (gSystem->AccessPathName(macro.c_str())) {
+            std::ofstream(macro) << source;
+        }
+        if (gSystem->CompileMacro(macro.c_str(), "kOs", "", jit_cache_dir.c_str()) == 1) {
+            loop = reinterpret_cast<EventLoop>(gSystem->DynFindSymbol("*", name.str().c_str()));
+        }
+    }
+    else if (gInterpreter->Declare(source.c_str())) {
+        loop = reinterpret_cast<EventLoop>(gInterpreter->Calc(("(long)&" + name.str()).c_str()));
+    }
+    if (loop == nullptr) {
+        std::cout << "\033[07m\033[93m[WARNING]\033[0m Compilation of " << name.str()
+                  << " failed, using generic event loop\n";
+    }
+    jit_loops[name.str()] = loop;
+    return loop;
+}
+
+
+void Ranger::fillCartesian(TTree* output_tree,
+                           std::vector<UInt_t>& array_elem_it,
+                           const std::vector<UInt_t>& array_length)
+{
+    // Fills all combinations of array elements of all groups, last group runs fastest
+    int n_groups = array_length.size();
+    if (std::count(array_length.begin(), array_length.end(), 0u) > 0) {
+        return;
+    }
+    for (int group = 0; group < n_groups; ++group) {
+        array_elem_it[group] = 0;
+        incrementBuffers(0, group);
+    }
+    while (true) {
+        output_tree->Fill();
+        int group = n_groups - 1;
+        while (group >= 0 && ++array_elem_it[group] == array_length[group]) {
+            array_elem_it[group] = 0;
+            incrementBuffers(0, group);
+            --group;
+        }
+        if (group < 0) {
+            return;
+        }
+        incrementBuffers(array_elem_it[group], group);
+    }
 }
 
 
-TLeaf* Ranger::analyzeLeaves_FillLeafBuffers(TTree* input_tree, TTree* output_tree,
-                                             std::vector<TLeaf*>& all_leaves,
-                                             std::vector<TLeaf*>& sel_leaves)
+std::vector<std::string> Ranger::analyzeLeaves_FillLeafBuffers(TTree* input_tree,
+                                                               TreeSchema& schema,
+                                                               std::vector<TLeaf*>& all_leaves,
+                                                               std::vector<TLeaf*>& sel_leaves)
 {
     // Analyzes the selected leaves and finds out their dimensionality
     // Multidimensional leaves are assigned more buffer space according
     // to maximum value in array_length leaf that is returned by leaf->GetLeafCount()
-    // Returns pointer to array length leaf
-
-    std::map<TLeaf*, std::pair<size_t, bool>> array_length_leaves; // ... and corresponding buffer sizes and whether to flatten them
+    // times the size of fixed inner dimensions, e.g. 3 for leaf[n][3].
+    // Selected leaves are grouped by their array length leaf.
+    // Returns names of array length leaves of the groups.
+    // Leaves are only accessed before the maxima of the array length leaves are
+    // determined, since a TChain replaces its leaves when loading the next file.
+    // Leaf structure and maxima are taken from the tree schema if already known.
+
+    // Leaf buffers are allocated in the leaf arena in a second pass, after
+    // the total buffer size of the job is known
+    struct LeafLayout {
+        std::string name;
+        const LeafSchema* leaf;
+        TString name_after;
+        std::string leaflist;
+        int stride;
+        int group;
+        size_t buffer_size;
+    };
+    std::vector<LeafLayout> leaf_layout;
+    size_t arena_bytes = 0;
+
+    std::vector<std::string> array_length_groups; // Array length leaves of selected leaves
 
     for (const auto& leaf : all_leaves) {
         TString LeafName = leaf->GetName();
         TString LeafNameAfter = LeafName;
 
-        bool assign_bufferindex = false;
-        size_t buffer_size = 1;
+        auto leaf_schema = schema.leaves.find(std::string(LeafName));
+        if (leaf_schema == schema.leaves.end()) {
+            std::cerr << "\033[07m\033[93m[WARNING]\033[0m Discarding " << LeafName << " since leaf type "
+                      << leaf->GetTypeName() << " is not supported!\n";
+            continue;
+        }
+        const LeafSchema& ls = leaf_schema->second;
 
-        // Find out leaf dimension
-        Int_t probe;
-        TLeaf* dim_leaf = leaf->GetLeafCounter(probe);
+        int group = -1;
+        int stride = 1;
 
-        if (dim_leaf == nullptr) {
-            if (probe > 1) {
-                // Leaf elements are arrays / matrices of constant length > 1
-                // found_const_array = true;
-            }
-            // else probe = 1 -> scalar
-            buffer_size = probe;
-        }
-        else {
-            // Leaf elements are arrays / matrices of variable length
+        // Leaf title is the leaf name with dimensions, e.g. "B0_PX[nPV]"
+        std::string leaflist = ls.title;
 
-        // Get max buffer size if unknown
-        if (array_length_leaves.find(dim_leaf) == array_length_leaves.end()) {
-            input_tree->SetBranchStatus(dim_leaf->GetName(), 1); // !
-            array_length_leaves[dim_leaf] = std::make_pair(input_tree->GetMaximum(dim_leaf->GetName()), false);
-        }
-        if (contains(sel_leaves, leaf)) {
+        // No array length leaf:
+        //     probe > 1: Leaf elements are arrays / matrices of constant length
+        //     else probe = 1 -> scalar
+        // else:
+        //     Leaf elements are arrays / matrices of variable length
+        //     probe is the number of elements per array entry
+        if (!ls.array_length_leaf.empty() && contains(sel_leaves, leaf)) {
             // Mark leaf for flattening / bpv selection
+            auto group_it = std::find(array_length_groups.begin(), array_length_groups.end(), ls.array_length_leaf);
+            group = group_it - array_length_groups.begin();
+            if (group_it == array_length_groups.end()) {
+                array_length_groups.push_back(ls.array_length_leaf);
+            }
             LeafNameAfter += "_flat";
-            assign_bufferindex = true;
-            array_length_leaves[dim_leaf].second = true; // Use for alignment
+            stride = ls.probe;
+            leaflist = std::string(LeafNameAfter) + (stride > 1 ? '[' + std::to_string(stride) + ']' : "");
         }
-        buffer_size = array_length_leaves[dim_leaf].first;
+        if (!contains(leaflist, '/')) {
+            leaflist += std::string("/") + DataTypeNamesShort[ls.type];
         }
 
-        input_tree->SetBranchStatus(LeafName, 1);
+        leaf_layout.push_back({std::string(LeafName), &ls, LeafNameAfter, leaflist, stride, group, 0});
+    }
 
-        switch (LeafTypeFromStr.find(leaf->GetTypeName())->second) {
-            case leaf_char:    addLeaf<   Char_t>(leaf, LeafNameAfter, input_tree, output_tree, buffer_size, assign_bufferindex); break;
-            case leaf_uchar:   addLeaf<  UChar_t>(leaf, LeafNameAfter, input_tree, output_tree, buffer_size, assign_bufferindex); break;
-            case leaf_short:   addLeaf<  Short_t>(leaf, LeafNameAfter, input_tree, output_tree, buffer_size, assign_bufferindex); break;
-            case leaf_ushort:  addLeaf< UShort_t>(leaf, LeafNameAfter, input_tree, output_tree, buffer_size, assign_bufferindex); break;
-            case leaf_int:     addLeaf<    Int_t>(leaf, LeafNameAfter, input_tree, output_tree, buffer_size, assign_bufferindex); break;
-            case leaf_uint:    addLeaf<   UInt_t>(leaf, LeafNameAfter, input_tree, output_tree, buffer_size, assign_bufferindex); break;
-            case leaf_float:   addLeaf<  Float_t>(leaf, LeafNameAfter, input_tree, output_tree, buffer_size, assign_bufferindex); break;
-            case leaf_double:  addLeaf< Double_t>(leaf, LeafNameAfter, input_tree, output_tree, buffer_size, assign_bufferindex); break;
-            case leaf_long64:  addLeaf< Long64_t>(leaf, LeafNameAfter, input_tree, output_tree, buffer_size, assign_bufferindex); break;
-            case leaf_ulong64: addLeaf<ULong64_t>(leaf, LeafNameAfter, input_tree, output_tree, buffer_size, assign_bufferindex); break;
+    // Get max buffer sizes if unknown
+    for (const auto& l : leaf_layout) {
+        const auto& array_length = l.leaf->array_length_leaf;
+        if (!array_length.empty() && schema.array_length_max.find(array_length) == schema.array_length_max.end()) {
+            input_tree->SetBranchStatus(array_length.c_str(), 1); // !
+            schema.array_length_max[array_length] = input_tree->GetMaximum(array_length.c_str());
         }
     }
 
-    if (array_length_leaves.size() > 1) {
-        TLeaf* alignLeaf = nullptr;
-        std::cout << "\033[07m\033[93m[WARNING]\033[0m More than one array length leaf found:\n";
-        for (auto& arl : array_length_leaves) {
-            if(arl.second.second) {
-                alignLeaf = arl.first;
-                std::cout << alignLeaf->GetName() << '\n';
-            }
+    for (auto& l : leaf_layout) {
+        const auto& array_length = l.leaf->array_length_leaf;
+        l.buffer_size = array_length.empty() ? l.leaf->probe : schema.array_length_max[array_length] * l.leaf->probe;
+        if (!array_length.empty()) {
+            input_tree->SetBranchStatus(array_length.c_str(), 1);
+        }
+        arena_bytes += LeafArena::footprint(LeafTypeSize.find(l.leaf->type)->second,
+                                            l.buffer_size + (l.group >= 0 ? l.stride : 0));
+        input_tree->SetBranchStatus(l.name.c_str(), 1);
+    }
+
+    reserveLeafArena(arena_bytes);
+
+    for (auto& l : leaf_layout) {
+        switch (l.leaf->type) {
+            case leaf_char:    addLeaf<   Char_t>(l.name, l.name_after, l.leaflist, input_tree, l.buffer_size, l.stride, l.group); break;
+            case leaf_uchar:   addLeaf<  UChar_t>(l.name, l.name_after, l.leaflist, input_tree, l.buffer_size, l.stride, l.group); break;
+            case leaf_short:   addLeaf<  Short_t>(l.name, l.name_after, l.leaflist, input_tree, l.buffer_size, l.stride, l.group); break;
+            case leaf_ushort:  addLeaf< UShort_t>(l.name, l.name_after, l.leaflist, input_tree, l.buffer_size, l.stride, l.group); break;
+            case leaf_int:     addLeaf<    Int_t>(l.name, l.name_after, l.leaflist, input_tree, l.buffer_size, l.stride, l.group); break;
+            case leaf_uint:    addLeaf<   UInt_t>(l.name, l.name_after, l.leaflist, input_tree, l.buffer_size, l.stride, l.group); break;
+            case leaf_float:   addLeaf<  Float_t>(l.name, l.name_after, l.leaflist, input_tree, l.buffer_size, l.stride, l.group); break;
+            case leaf_double:  addLeaf< Double_t>(l.name, l.name_after, l.leaflist, input_tree, l.buffer_size, l.stride, l.group); break;
+            case leaf_long64:  addLeaf< Long64_t>(l.name, l.name_after, l.leaflist, input_tree, l.buffer_size, l.stride, l.group); break;
+            case leaf_ulong64: addLeaf<ULong64_t>(l.name, l.name_after, l.leaflist, input_tree, l.buffer_size, l.stride, l.group); break;
         }
-        std::cout << "\033[07m\033[93m[WARNING]\033[0m Using " << alignLeaf->GetName() << " leaf for alignment. Make sure this is intended\n";
-        return alignLeaf;
     }
-    return array_length_leaves.begin()->first;
+    return array_length_groups;
+}
+
+
+void Ranger::bookOutputBranches(TTree* output_tree, int only_group)
+{
+    bookBranches<   Char_t>(output_tree, only_group);
+    bookBranches<  UChar_t>(output_tree, only_group);
+    bookBranches<  Short_t>(output_tree, only_group);
+    bookBranches< UShort_t>(output_tree, only_group);
+    bookBranches<    Int_t>(output_tree, only_group);
+    bookBranches<   UInt_t>(output_tree, only_group);
+    bookBranches<  Float_t>(output_tree, only_group);
+    bookBranches< Double_t>(output_tree, only_group);
+    bookBranches< Long64_t>(output_tree, only_group);
+    bookBranches<ULong64_t>(output_tree, only_group);
 }
 
 
@@ -477,6 +1678,10 @@ void Ranger::getListOfBranchesBySelection(std::vector<TLeaf*>& selected, TTree*
     // Collects leaves that match regex
     TObjArray* leaf_list = target_tree->GetListOfLeaves();
     std::string regex_select;
+    if (leaf_list == nullptr) {
+        // Empty chain
+        return;
+    }
 
     // Remove whitespace
     for (auto c = selection.begin(); c != selection.end();) {
@@ -550,8 +1755,8 @@ void Ranger::addFormulaBranch(TTree* output_tree, const std::string& name, std::
 
     TFormula tformula("F", TString(formula));
 
-    int n_entries = output_tree->GetEntriesFast();
-    for (int event = 0; event < n_entries; ++event) {
+    Long64_t n_entries = output_tree->GetEntriesFast();
+    for (Long64_t event = 0; event < n_entries; ++event) {
         output_tree->GetEntry(event);
         result = tformula.EvalPar(nullptr, &buffer[0]);
 
@@ -12,34 +12,54 @@
 #include <string>
 #include <iomanip>
 #include <set>
+#include <queue>
+#include <tuple>
 #include <unordered_set>
 #include <map>
 #include <memory>
+#include <fstream>
+#include <sstream>
+#include <functional>
+#include <cctype>
+#include <thread>
+#include <atomic>
 
 #include "TString.h"
 #include "TFormula.h"
 #include "TFile.h"
+#include "TKey.h"
 #include "TTree.h"
+#include "TChain.h"
+#include "ROOT/RDataFrame.hxx"
 #include "TLeaf.h"
+#include "TROOT.h"
+#include "TFileMerger.h"
+#include "TTreeIndex.h"
+#include "TEntryList.h"
+#include "TSystem.h"
+#include "TInterpreter.h"
 
 #include "LeafBuffer.h"
 
-// Buffer stores a list of leaves of a given datatype and a list of
-// indices of leaves in the first buffer, that have array dimension
-// and need to be flattened
+// Buffer stores a list of leaves of a given datatype and, for each array
+// length leaf, a list of indices of leaves in the first buffer that have
+// array dimension and need to be flattened
 
 
 template<typename L>
-using Buffer = std::pair<std::vector<LeafBuffer<L>>, std::vector<int>>;
+using Buffer = std::pair<std::vector<LeafBuffer<L>>, std::vector<std::vector<int>>>;
 
 using FilePtr = std::unique_ptr<TFile>;
 
 class Ranger {
 public:
     Ranger(const TString& rootfile);
-    virtual ~Ranger() { }
+    Ranger(const std::vector<std::string>& rootfiles);
+    virtual ~Ranger();
 
     void setInputFile(const TString& rootfile);
+    // Trees of multiple input files are processed as one TChain
+    void setInputFiles(const std::vector<std::string>& rootfiles);
 
     // Tree job parser methods
     void TreeCopy(const std::string& treename,
@@ -47,11 +67,15 @@ public:
                   const std::string& cut_selection="",
                   const std::string& rename="");
 
+    // If leaves with different array length leaves are flattened, flatten_mode
+    // decides how they are combined: "zip" (element-wise, lengths must agree),
+    // "cartesian" (all combinations) or "split" (one tree per array length leaf)
     void FlattenTree(const std::string& treename,
                      const std::string& branch_selection,
                      const std::string& flat_branch_selection,
                      const std::string& cut_selection="",
-                     const std::string& rename="");
+                     const std::string& rename="",
+                     const std::string& flatten_mode="zip");
 
     void BPVselection(const std::string& treename,
                       const std::string& branch_selection,
@@ -61,12 +85,44 @@ public:
 
     void addFormula(const std::string& name, std::string formula);
 
+    // Selects execution engine for all jobs defined afterwards: "legacy" event loop
+    // or "rdf" (RDataFrame, reads only the selected columns). n_threads != 1 enables ROOT's implicit
+    // multithreading while these jobs run, 0 uses all cores
+    void setEngine(const std::string& engine, int n_threads=1);
+
+    // Runs flattening (zip mode) and BPV jobs with event loops that are generated for
+    // the leaf structure of the job and compiled once. Compiled loops are kept in
+    // cache_dir for later processes, otherwise they are compiled by the interpreter
+    void setJIT(bool enable, const std::string& cache_dir="");
+
     // Runs all specified Ranger jobs in sequence
     void Run(const std::string& output_filename);
 
+    // Splits output into chunks of at most max_entries entries or max_bytes
+    // compressed bytes per tree. Output trees are written into the chunk files
+    // directly. A value of 0 disables the respective limit
+    void setOutputSplitting(Long64_t max_entries, Long64_t max_bytes=0);
+
+    // Writes all output trees sorted by major and minor key branch and stores a TTreeIndex.
+    // Trees exceeding memory_budget bytes are sorted in runs that are merged afterwards
+    void setOutputSorting(const std::string& major, const std::string& minor="0",
+                          size_t memory_budget=size_t(1) << 30);
+
+    // Merges same-schema output files into target as parallel tree reduction.
+    // Fast merging keeps the clusters of the inputs, with recluster the last
+    // level re-encodes the baskets into clusters of the target
+    static void Merge(const std::vector<std::string>& outputs,
+                      const std::string& target,
+                      int n_threads=0,
+                      int fan_in=8,
+                      bool recluster=false);
+
     // Reset Ranger jobs
     void reset();
 
+    // Limits the memory used for leaf buffers of a single job, 0 means no limit
+    void setLeafBufferMemoryLimit(size_t n_bytes);
+
     void dev();
 
     enum Action {
@@ -77,6 +133,12 @@ public:
         add_formula
     };
 
+    enum FlattenMode {
+        flatten_zip,
+        flatten_cartesian,
+        flatten_split
+    };
+
     struct TreeJob {
         // TreeJob stores everything Ranger needs to
         // know about an operation performed on a single tree
@@ -96,37 +158,125 @@ public:
         Action action;
     };
 
+    // Structure of a leaf in an input tree
+    struct LeafSchema {
+        std::string title;             // Leaf name with dimensions
+        std::string array_length_leaf; // Empty if leaf has no variable array length
+        LeafType type;
+        int probe;                     // Number of elements (per array entry)
+    };
+
+    // Structure of an input tree, shared by all jobs on this tree
+    struct TreeSchema {
+        std::map<std::string, LeafSchema> leaves;
+        std::map<std::string, size_t> array_length_max; // Maximum values of array length leaves
+    };
+
 private:
     // Utility methods
     void closeFile(TFile*);
     // Initializes unique temporary filename in target directory
     void initTmpFilename(std::string outFileName);
+    // Returns unique hidden filename next to target, used for intermediate merge results
+    static std::string hiddenSiblingName(const std::string& target, const std::string& tag);
+    // Merges list of files into target, fast merging copies the baskets
+    static bool mergeFiles(const std::vector<std::string>& inputs, const std::string& target, bool fast=true);
     // Clears all leaf buffers
     void clearLeafBuffers() noexcept;
     // Adds additional formula branches and a cut selection
     void AddBranchesAndCuts(const TreeJob&, TTree*, bool directCopy=false);
     // Loops over list of leaves, determines datatype and dimension and allocates
-    // buffer space
-    TLeaf* analyzeLeaves_FillLeafBuffers(TTree* input_tree, TTree* output_tree,
-                                         std::vector<TLeaf*>& all_leaves,
-                                         std::vector<TLeaf*>& bpv_leaves);
+    // buffer space. Returns names of array length leaves of selected leaves (one per group)
+    std::vector<std::string> analyzeLeaves_FillLeafBuffers(TTree* input_tree,
+                                                           TreeSchema& schema,
+                                                           std::vector<TLeaf*>& all_leaves,
+                                                           std::vector<TLeaf*>& sel_leaves);
+    // Creates output branches of all leaf buffers, only_group >= 0 restricts
+    // flattened leaves to the given array length leaf group
+    void bookOutputBranches(TTree* output_tree, int only_group=-1);
+    // Generated event loop, returns number of skipped events
+    using EventLoop = Long64_t (*)(TTree* input_tree, TTree* output_tree, void** slots, UInt_t* array_elem_it);
+    // Returns compiled event loop for current leaf buffers, fills slots with buffer addresses
+    EventLoop getCompiledEventLoop(const std::vector<std::string>& array_length_names,
+                                   bool flatten, std::vector<void*>& slots);
+    // Generates buffer declarations and element copies of a leaf buffer group
+    template<typename L>
+    void generateCopies(std::string& declarations, std::string& copies,
+                        std::vector<void*>& slots, int group);
+    // Returns name of datatype L
+    template<typename L> static const char* typeName();
+    // Fills output tree with all combinations of array elements of all groups
+    void fillCartesian(TTree* output_tree,
+                       std::vector<UInt_t>& array_elem_it,
+                       const std::vector<UInt_t>& array_length);
+    template<typename L>
+    void bookBranches(TTree* output_tree, int only_group);
+    // Reserves leaf arena memory for given number of bytes, respects memory limit
+    void reserveLeafArena(size_t n_bytes);
     // Returns pointer to leaf buffer of datatype L
     template<typename L> Buffer<L>* getBuffer();
 
     // Adds a leaf to a buffer, called by analyzeLeaves_FillLeafBuffers()
     template<typename L>
-    void addLeaf(const TLeaf* ref_leaf, TString& leaf_name,
-                 TTree* tree_in, TTree* tree_out,
-                 size_t buffer_size, bool assign_index);
+    void addLeaf(const std::string& input_name, const TString& leaf_name,
+                 const std::string& leaflist, TTree* tree_in,
+                 size_t buffer_size, int stride, int group);
 
     // Moves element inc in leaf buffer to the read address position
     template<typename L>
-    void inline incrementBuffer(int inc);
+    void inline incrementBuffer(int inc, int group);
+    // Moves element inc of all leaves in array length leaf group
+    void inline incrementBuffers(int inc, int group);
     // Matches branch names by regex
     void getListOfBranchesBySelection(std::vector<TLeaf*>&,
                                       TTree* target_tree,
                                       std::string selection);
 
+    // Output tree that is written to consecutive chunk files
+    struct OutputChunk {
+        std::string tree_name;
+        std::vector<std::pair<std::string, std::string>> formulas; // Added to every chunk
+        bool build_index = false; // TTreeIndex of sort key in every chunk
+        size_t index = 0;         // Number of current chunk file
+        Long64_t first_entry = 0; // Entry of first chunk entry in unsplit tree
+        FilePtr file;
+        TTree* tree = nullptr;
+    };
+    // Whether output splitting is enabled
+    bool splitting() const;
+    // Whether chunk tree has to be closed after the last fill
+    bool chunkFull(TTree* chunk_tree) const;
+    // Opens next chunk file with an empty clone of source
+    void openChunk(OutputChunk&, TTree* source);
+    // Fills current entry of source into chunk, closes chunk if it is full
+    void fillChunk(OutputChunk&, TTree* source);
+    // Adds formulas and index, writes chunk tree and adds it to the manifest
+    void closeChunk(OutputChunk&);
+    // Closes last chunk of tree
+    void finishChunks(OutputChunk&, TTree* source);
+    // Copies entries of source passing cut into chunk files of tree_name
+    void writeChunks(TTree* source, const std::string& tree_name, const std::string& cut,
+                     const std::vector<std::pair<std::string, std::string>>& formulas);
+
+    // Evaluates cut on source into entry list, nullptr without cut
+    TEntryList* selectEntries(TTree* source, const std::string& cut, const std::string& tree_name);
+    // Removes entry list from source
+    static void clearSelection(TTree* source, TEntryList* selection);
+
+    // Writes entries of source passing cut sorted by key, false if source has no sort key
+    bool writeSorted(TTree* source, const std::string& tree_name, const std::string& cut);
+    // Merges sorted runs, fill is called for every entry in key order
+    void mergeRuns(const std::vector<TTree*>& runs, TTree* source, const std::function<void()>& fill);
+    // Reads sort key of the current entry of tree
+    static std::pair<long double, long double> readSortKey(TLeaf* major, TLeaf* minor);
+
+    // Expands wildcards in input file name
+    static std::vector<std::string> expandInputPattern(const std::string& pattern);
+    // Returns cached input tree, a chain of tree_in over all input files
+    TTree* getInputTree(const TreeJob&);
+    // Returns cached leaf structure of tree_in
+    TreeSchema& getTreeSchema(const TreeJob&, TTree* input_tree);
+
     // Checks whether TTree and TDirectory exist
     void JobValidityCheck(const TreeJob&);
     /////////////////////////
@@ -135,6 +285,10 @@ private:
     void SimpleCopy(TreeJob&);
     void flattenTree(const TreeJob&);
     void BestPVSelection(TreeJob&);
+    // RDataFrame engine
+    bool useDataFrame(const TreeJob&);
+    static std::string formulaToCpp(std::string formula);
+    void DataFrameJob(TreeJob&);
     void addFormulaBranch(TTree* output_tree,
                           const std::string& name,
                           std::string formula);
@@ -146,6 +300,26 @@ private:
     std::uniform_int_distribution<std::mt19937::result_type> distr;
 
     TString input_filename, temporary_file_name, outfile_name;
+    std::vector<std::string> input_filenames;
+
+    // File handles, input trees and their schemas are opened / analyzed once
+    FilePtr input_file;     //! First input file
+    FilePtr output_file;    //! Open during Run()
+    FilePtr temporary_file; //! Open during Run()
+    std::map<std::string, TTree*> input_trees;          //! Input trees by tree_in
+    std::vector<std::unique_ptr<TChain>> input_chains;  //! Owns chains of multiple input files
+    std::map<std::string, TreeSchema> schema_cache;     //! Schemas by tree_in
+
+    // Output splitting limits, 0 means unlimited
+    Long64_t split_max_entries = 0;
+    Long64_t split_max_bytes   = 0;
+    std::ofstream split_manifest;      //! Open during Run()
+    std::set<std::string> chunk_files; //! Chunk files written in Run()
+
+    // Output sorting key, empty major disables sorting
+    std::string sort_major;
+    std::string sort_minor = "0";
+    size_t sort_memory_budget = size_t(1) << 30;
 
     // Leaf buffer storage with indices of array-type leaves
     Buffer<Char_t>    leaf_buffers_B;
@@ -159,11 +333,31 @@ private:
     Buffer<Long64_t>  leaf_buffers_L;
     Buffer<ULong64_t> leaf_buffers_l;
 
+    // Memory of all leaf buffers, kept between jobs
+    LeafArena leaf_arena; //!
+    size_t leaf_memory_limit = 0;
+
     std::vector<std::pair<std::string, std::string>> formula_buffer;
 
+    // Engine of jobs defined next
+    std::string job_engine = "legacy";
+    int job_threads = 1;
+
+    // Compiled event loops by schema hash
+    bool jit_enabled = false;
+    std::string jit_cache_dir;
+    std::map<std::string, EventLoop> jit_loops; //!
+
     ClassDef(Ranger,1)
 };
 
+static const std::map<std::string, Ranger::FlattenMode> FlattenModeFromStr
+{
+    {"zip",       Ranger::flatten_zip},
+    {"cartesian", Ranger::flatten_cartesian},
+    {"split",     Ranger::flatten_split}
+};
+
 template<typename L>
 Buffer<L>* Ranger::getBuffer()
 {
@@ -182,12 +376,13 @@ Buffer<L>* Ranger::getBuffer()
 }
 
 template<typename L>
-void Ranger::addLeaf(const TLeaf* ref_leaf,
-                     TString& leaf_name,
+void Ranger::addLeaf(const std::string& input_name,
+                     const TString& leaf_name,
+                     const std::string& leaflist,
                      TTree* tree_in,
-                     TTree* tree_out,
                      size_t buffer_size,
-                     bool assign_index)
+                     int stride,
+                     int group)
 {
     if (buffer_size == 0) {
         std::cerr << "\033[07m\033[93m[WARNING]\033[0m Discarding " << leaf_name << " since variable is empty!\n";
@@ -195,31 +390,100 @@ void Ranger::addLeaf(const TLeaf* ref_leaf,
     }
     Buffer<L>* lb_vec = getBuffer<L>();
     // Create leaf store, link addresses
-    if (assign_index) {
-        lb_vec->second.push_back(lb_vec->first.size());
+    L* slot  = leaf_arena.allocate<L>(group >= 0 ? stride + buffer_size : buffer_size);
+    L* input = group >= 0 ? slot + stride : slot;
+    if (group >= 0) {
+        if (lb_vec->second.size() <= static_cast<size_t>(group)) {
+            lb_vec->second.resize(group + 1);
+        }
+        lb_vec->second[group].push_back(lb_vec->first.size());
     }
-    lb_vec->first.emplace_back(std::move(LeafBuffer<L>(buffer_size)));
+    lb_vec->first.emplace_back(slot, input, stride, group, std::string(leaf_name), leaflist);
 
-    tree_in->SetBranchAddress(ref_leaf->GetName(), &(lb_vec->first.back().buffer[0]));
+    tree_in->SetBranchAddress(input_name.c_str(), input);
+}
 
-    if (buffer_size > 1 && !assign_index) {
-        // constant array / matrix -> Keep dimension
-        tree_out->Branch(leaf_name, &(lb_vec->first.back().buffer[0]), ref_leaf->GetTitle());
+template<typename L>
+void Ranger::bookBranches(TTree* output_tree, int only_group)
+{
+    for (auto& leaf : getBuffer<L>()->first) {
+        if (leaf.group < 0 || only_group < 0 || leaf.group == only_group) {
+            output_tree->Branch(leaf.name.c_str(), leaf.buffer, leaf.leaflist.c_str());
+        }
     }
-    else {
-        tree_out->Branch(leaf_name, &(lb_vec->first.back().buffer[0]));
+}
+
+template<typename L>
+const char* Ranger::typeName()
+{
+    if constexpr (std::is_same<L,    Char_t>::value) return "Char_t";
+    if constexpr (std::is_same<L,   UChar_t>::value) return "UChar_t";
+    if constexpr (std::is_same<L,   Short_t>::value) return "Short_t";
+    if constexpr (std::is_same<L,  UShort_t>::value) return "UShort_t";
+    if constexpr (std::is_same<L,     Int_t>::value) return "Int_t";
+    if constexpr (std::is_same<L,    UInt_t>::value) return "UInt_t";
+    if constexpr (std::is_same<L,   Float_t>::value) return "Float_t";
+    if constexpr (std::is_same<L,  Double_t>::value) return "Double_t";
+    if constexpr (std::is_same<L,  Long64_t>::value) return "Long64_t";
+    if constexpr (std::is_same<L, ULong64_t>::value) return "ULong64_t";
+    return nullptr;
+}
+
+template<typename L>
+void Ranger::generateCopies(std::string& declarations, std::string& copies,
+                            std::vector<void*>& slots, int group)
+{
+    // Group < 0 generates copies of all flattened leaves
+    Buffer<L>* buffer = getBuffer<L>();
+    for (size_t g = 0; g < buffer->second.size(); ++g) {
+        if (group >= 0 && g != static_cast<size_t>(group)) {
+            continue;
+        }
+        for (auto& leaf_idx : buffer->second[g]) {
+            const auto& leaf = buffer->first[leaf_idx];
+            auto out = "out_" + std::to_string(slots.size());
+            auto in  = "in_"  + std::to_string(slots.size());
+            declarations += std::string("    auto ") + out + " = static_cast<" + typeName<L>() + "*>(slots["
+                          + std::to_string(slots.size()) + "]);\n";
+            declarations += std::string("    auto ") + in + " = static_cast<const " + typeName<L>() + "*>(slots["
+                          + std::to_string(slots.size() + 1) + "]);\n";
+            slots.push_back(leaf.buffer);
+            slots.push_back(leaf.input);
+            // Constant stride, loop is unrolled by the compiler
+            for (int s = 0; s < leaf.stride; ++s) {
+                copies += "            " + out + '[' + std::to_string(s) + "] = " + in + "[k * "
+                        + std::to_string(leaf.stride) + " + " + std::to_string(s) + "];\n";
+            }
+        }
     }
 }
 
 template<typename L>
-void inline Ranger::incrementBuffer(int inc)
+void inline Ranger::incrementBuffer(int inc, int group)
 {
     Buffer<L>* buffer = getBuffer<L>();
-    for (auto& leaf_idx : buffer->second) {
+    if (static_cast<size_t>(group) >= buffer->second.size()) {
+        return;
+    }
+    for (auto& leaf_idx : buffer->second[group]) {
         buffer->first[leaf_idx].increment(inc);
     }
 }
 
+void inline Ranger::incrementBuffers(int inc, int group)
+{
+    incrementBuffer<   Char_t>(inc, group);
+    incrementBuffer<  UChar_t>(inc, group);
+    incrementBuffer<  Short_t>(inc, group);
+    incrementBuffer< UShort_t>(inc, group);
+    incrementBuffer<    Int_t>(inc, group);
+    incrementBuffer<   UInt_t>(inc, group);
+    incrementBuffer< Double_t>(inc, group);
+    incrementBuffer<  Float_t>(inc, group);
+    incrementBuffer< Long64_t>(inc, group);
+    incrementBuffer<ULong64_t>(inc, group);
+}
+
 template<typename T>
 bool inline contains(const std::vector<T>& vec, const T& elem)
 {
@@ -0,0 +1,83 @@
+"""Compares run times of the event loop and the RDataFrame engine.
+   Usage: python benchmark_engines.py [n_events] [n_threads]"""
+import os
+import sys
+import time
+import ROOT
+from root_ranger import Ranger
+
+ROOT.gInterpreter.Declare("""
+void ranger_benchmark_tuple(const char* filename, Long64_t n_events)
+{
+    // Tuple with scalar leaves and leaves of variable array length
+    TFile file(filename, "RECREATE");
+    TTree tree("DecayTree", "DecayTree");
+    TRandom3 rng(42);
+    const int max_pv = 8;
+    Int_t nPV;
+    Double_t B0_M, B0_PT, Kaon_PX, Kaon_PY, B0_Fit_M[max_pv], B0_Fit_chi2[max_pv];
+    Float_t B0_Fit_PT[max_pv];
+    ULong64_t eventNumber;
+    tree.Branch("nPV",         &nPV,         "nPV/I");
+    tree.Branch("eventNumber", &eventNumber, "eventNumber/l");
+    tree.Branch("B0_M",        &B0_M,        "B0_M/D");
+    tree.Branch("B0_PT",       &B0_PT,       "B0_PT/D");
+    tree.Branch("Kaon_PX",     &Kaon_PX,     "Kaon_PX/D");
+    tree.Branch("Kaon_PY",     &Kaon_PY,     "Kaon_PY/D");
+    tree.Branch("B0_Fit_M",    B0_Fit_M,     "B0_Fit_M[nPV]/D");
+    tree.Branch("B0_Fit_chi2", B0_Fit_chi2,  "B0_Fit_chi2[nPV]/D");
+    tree.Branch("B0_Fit_PT",   B0_Fit_PT,    "B0_Fit_PT[nPV]/F");
+    for (Long64_t event = 0; event < n_events; ++event) {
+        eventNumber = event;
+        nPV = rng.Integer(max_pv) + 1;
+        B0_M    = rng.Gaus(5280, 50);
+        B0_PT   = rng.Exp(5000);
+        Kaon_PX = rng.Gaus(0, 1000);
+        Kaon_PY = rng.Gaus(0, 1000);
+        for (int pv = 0; pv < nPV; ++pv) {
+            B0_Fit_M[pv]    = B0_M + rng.Gaus(0, 10);
+            B0_Fit_chi2[pv] = rng.Exp(5);
+            B0_Fit_PT[pv]   = B0_PT + rng.Gaus(0, 100);
+        }
+        tree.Fill();
+    }
+    tree.Write();
+}
+""")
+
+JOBS = {
+    'copy':             lambda r: r.copy_tree("DecayTree"),
+    'copy + cut':       lambda r: r.copy_tree("DecayTree", cut="B0_M>5300"),
+    'copy + branches':  lambda r: r.copy_tree("DecayTree", branches=["B0_M", "B0_PT", "eventNumber"]),
+    'copy + formula':   lambda r: (r.add_formula("Kaon_PT", "TMath::Sqrt(#Kaon_PX**2+#Kaon_PY**2)"),
+                                   r.copy_tree("DecayTree", cut="Kaon_PT>500")),
+    'bpv':              lambda r: r.bpv_selection("DecayTree", bpv_branches="B0_Fit*"),
+    'bpv + cut':        lambda r: r.bpv_selection("DecayTree", bpv_branches="B0_Fit*", cut="B0_M>5300"),
+}
+
+
+def run(infile, job, engine, n_threads):
+    ranger = Ranger(infile)
+    ranger.set_engine(engine, n_threads)
+    JOBS[job](ranger)
+    outfile = "benchmark_{0}_out.root".format(engine)
+    start = time.time()
+    ranger.run(outfile)
+    elapsed = time.time() - start
+    os.remove(outfile)
+    return elapsed
+
+
+if __name__ == '__main__':
+    n_events  = int(sys.argv[1]) if len(sys.argv) > 1 else 1000000
+    n_threads = int(sys.argv[2]) if len(sys.argv) > 2 else 0
+    infile = "benchmark_tuple.root"
+    ROOT.ranger_benchmark_tuple(infile, n_events)
+
+    print("{0:<18}{1:>10}{2:>10}{3:>14}".format("job", "legacy", "rdf", "rdf (MT)"))
+    for job in JOBS:
+        times = [run(infile, job, "legacy", 1),
+                 run(infile, job, "rdf", 1),
+                 run(infile, job, "rdf", n_threads)]
+        print("{0:<18}{1:>9.2f}s{2:>9.2f}s{3:>13.2f}s".format(job, *times))
+    os.remove(infile)
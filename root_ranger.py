@@ -11,7 +11,13 @@ gSystem.Load(os.path.join(thispath, 'ranger.so'))
 
 class Ranger:
     def __init__(self, file):
-        self.__ranger = ROOT.Ranger(file)
+        """file can be a file name, a wildcard pattern or a list of these.
+           Trees in multiple files are processed as one TChain"""
+        if isinstance(file, list):
+            self.__ranger = ROOT.Ranger(self.__string_vector(file))
+        else:
+            self.__ranger = ROOT.Ranger(file)
+        self.__splitting = False
 
     def copy_tree(self, treename, dest='', branches='*', cut=''):
         """Copies a TTree to a new file using a branch selection and an optional cut"""
@@ -20,15 +26,21 @@ class Ranger:
                                self.__parse_cut(cut),
                                dest)
 
-    def flatten_tree(self, treename, flat_branches, branches='*', cut='', dest=''):
+    def flatten_tree(self, treename, flat_branches, branches='*', cut='', dest='', mode='zip'):
         """Uses the leaf counter variable associated with the branches in flat_branches
            to reduce the dimensionality of these leaves. If multiple different leaf counters
-           are used, they need to have the same contents."""
+           are used, mode decides how they are combined:
+           'zip':       Elements with the same index are combined. Events where the leaf
+                        counters differ are skipped.
+           'cartesian': All combinations of elements are written.
+           'split':     One tree per leaf counter is written, named dest_<leaf counter>.
+           All modes read the input tree only once."""
         self.__ranger.FlattenTree(treename,
                                   self.__construct_regex(branches),
                                   self.__construct_regex(flat_branches),
                                   self.__parse_cut(cut),
-                                  dest)
+                                  dest,
+                                  mode)
 
     def bpv_selection(self, treename, bpv_branches, branches='*', cut='', dest=''):
         """If branch elements have array dimension, bpv_selection only selects the first
@@ -41,11 +53,13 @@ class Ranger:
                                    self.__parse_cut(cut),
                                    dest)
 
-    def add_selection(self, treename, dest='', branches='*', cut='', flat_branches='', bpv_branches=''):
+    def add_selection(self, treename, dest='', branches='*', cut='', flat_branches='', bpv_branches='',
+                      flatten_mode='zip'):
         """Copies a TTree to a new file using a branch selection and an optional cut.
         If flat_branches is used, the leaf counter variable associated with the branches in
         flat_branches is used to reduce the dimensionality of these leaves. If multiple
-        different leaf counters are used, they need to have the same contents.
+        different leaf counters are used, they are combined according to flatten_mode
+        (see flatten_tree).
         If bpv_branches is used and branch elements have array dimension, bpv_selection only
         selects the first element and discards the rest. This is often required for a bpv
         selection if the DecayTreeFitter is used.
@@ -57,7 +71,8 @@ class Ranger:
                                       self.__construct_regex(branches),
                                       self.__construct_regex(flat_branches),
                                       self.__parse_cut(cut),
-                                      dest)
+                                      dest,
+                                      flatten_mode)
         elif bpv_branches:
             self.__ranger.BPVselection(treename,
                                        self.__construct_regex(branches),
@@ -76,24 +91,100 @@ class Ranger:
         """
         self.__ranger.addFormula(formula_name, formula)
 
+    def set_engine(self, engine, n_threads=1):
+        """Selects the engine of all jobs defined afterwards.
+           'legacy': Event loop that reads and writes entry by entry
+           'rdf':    RDataFrame graph, which reads only the selected branches (columnar).
+                     Flattening and formulas with '^' always use the event loop.
+           n_threads != 1 runs these jobs with ROOT's implicit multithreading, 0 uses all cores.
+           With multithreading, the entry order of RDataFrame outputs is not preserved."""
+        self.__ranger.setEngine(engine, n_threads)
+
+    def set_jit(self, enable=True, cache_dir=''):
+        """Runs flattening (zip mode) and best PV selection jobs with event loops
+           generated for the leaf structure of the job and compiled once.
+           With cache_dir, compiled loops are stored as shared libraries and reused
+           by later processes. Falls back to the generic event loop on failure."""
+        self.__ranger.setJIT(enable, cache_dir)
+
     def reset(self):
         """Resets all root_ranger tree jobs"""
         self.__ranger.reset()
 
     def set_input_file(self, file):
-        """Sets a new input file"""
-        self.__ranger.setInputFile(file)
+        """Sets a new input file. file can be a file name, a wildcard pattern or a list of these.
+           Trees in multiple files are processed as one TChain"""
+        if isinstance(file, list):
+            self.__ranger.setInputFiles(self.__string_vector(file))
+        else:
+            self.__ranger.setInputFile(file)
+
+    def set_leaf_buffer_memory_limit(self, n_bytes):
+        """Limits the memory used for the leaf buffers of a single tree job.
+           Jobs that need more memory abort. Use 0 to disable the limit."""
+        self.__ranger.setLeafBufferMemoryLimit(n_bytes)
+
+    def set_output_splitting(self, max_entries=0, max_bytes=0):
+        """Splits output trees into files outfile_0001.root, outfile_0002.root, ...
+           of at most max_entries entries or max_bytes compressed bytes per tree.
+           Chunks are filled while writing, flattening and BPV trees are only stored
+           in the temporary file before. The entry limit is exact, the byte limit is
+           checked at cluster boundaries (within the first cluster of a chunk against
+           the uncompressed size). The entry range of every chunk is listed in
+           outfile_manifest.txt. Use 0 to disable a limit. Split outputs cannot be
+           appended to, run aborts if outfile or its chunks exist already."""
+        self.__ranger.setOutputSplitting(max_entries, max_bytes)
+        self.__splitting = max_entries > 0 or max_bytes > 0
+
+    def set_output_sorting(self, major, minor='0', memory_budget=1 << 30):
+        """Writes all output trees containing the branch major sorted by (major, minor)
+           and stores a TTreeIndex, e.g. major='runNumber', minor='eventNumber'.
+           Trees larger than memory_budget bytes are sorted in runs via the
+           temporary file, which are merged afterwards. The number of runs merged
+           at once is limited by memory_budget as well. Equal keys keep their order.
+           Jobs with the RDataFrame engine use the event loop when sorting."""
+        self.__ranger.setOutputSorting(major, minor, memory_budget)
 
     def run(self, outfile):
         """Runs all previously defined selections in sequence"""
         self.__ranger.Run(outfile)
 
-    def run_multiple(self, infiles, outfiles):
-        """Runs all previously defined selections in sequence on a list of root files"""
+    def run_multiple(self, infiles, outfiles, merge_into='', keep_outputs=True, n_threads=0):
+        """Runs all previously defined selections in sequence on a list of root files.
+           If merge_into is given, the outputs are merged into this file afterwards.
+           With keep_outputs=False, the per-file outputs are deleted after merging.
+           merge_into cannot be combined with output splitting."""
         assert len(infiles) == len(outfiles)
+        if merge_into and self.__splitting:
+            raise ValueError("merge_into cannot be used with output splitting, "
+                             "the outputs are replaced by their chunks")
+        # Run appends the extension to output names without it
+        outfiles = [f if f.endswith('.root') else f + '.root' for f in outfiles]
         for infile, outfile in tqdm(zip(infiles, outfiles), total=len(infiles)):
             self.__ranger.setInputFile(infile)
             self.__ranger.Run(outfile)
+        if merge_into:
+            self.merge(outfiles, merge_into, n_threads)
+            if not keep_outputs:
+                for outfile in outfiles:
+                    os.remove(outfile)
+
+    @staticmethod
+    def merge(files, target, n_threads=0, fan_in=8, recluster=False):
+        """Merges files with identical tree structure (e.g. outputs of run) into target.
+           Can be called without an instance, Ranger.merge(files, target).
+           Baskets are copied without recompression, files are merged in parallel
+           groups of fan_in files. n_threads=0 uses all available cores.
+           The clusters of the inputs are kept. recluster=True re-encodes the last
+           merge level, which is slower but gives the clustering of a single write."""
+        ROOT.Ranger.Merge(Ranger.__string_vector(files), target, n_threads, fan_in, recluster)
+
+    @staticmethod
+    def __string_vector(str_list):
+        vec = ROOT.std.vector('std::string')()
+        for s in str_list:
+            vec.push_back(s)
+        return vec
 
     def __parse_cut(self, cut):
         """If cuts are given as a list, they are joined by logical AND"""